@@ -4,6 +4,16 @@
 // Do not change it if you want to submit a homework.
 //=============================================================================================
 #include "framework.h"
+#include <chrono>
+#include <algorithm>
+#include <string.h>
+
+#if defined(__linux__)
+#include <EGL/egl.h>		// headless mode, link with -lEGL
+#include <EGL/eglext.h>
+#include <unistd.h>			// dup, dup2
+#define HEADLESS_SUPPORTED
+#endif
 
 // Initialization
 void onInitialization();
@@ -26,8 +36,280 @@ void onMouse(int button, int state, int pX, int pY);
 // Idle event indicating that some time elapsed: do animation here
 void onIdle();
 
+// The program ends, the context is still current: release the GL objects here, not in static destructors
+void onExit();
+
+static bool headless = false;									// rendering to an offscreen framebuffer without a window
+static int headlessFrames = 600;								// number of frames rendered in headless mode
+static const char* dumpPrefix = nullptr;						// headless frames are written to <dumpPrefix><frame>.bmp if set
+static bool benchmark = false;									// headless frame time measurement with a deterministic clock
+static const char* benchmarkOutput = nullptr;					// file of the benchmark report, stdout if not set
+static FILE* benchmarkStdout = nullptr;							// the original stdout if the report goes there, the prints go to stderr
+static const int benchmarkFps = 60;								// frame rate of the deterministic clock
+static const int benchmarkWarmup = 5;							// first frames of a benchmark, not included in the report
+static bool profile = false;									// scope timing with the overlay
+static const char* profileOutput = nullptr;						// file of the captured scopes, CSV or Chrome trace JSON
+static int frameCount = 0;										// frames completed in headless mode
+static std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+
+void swapBuffers() {
+	profiler().drawOverlay();
+	{
+		ProfileScope scope("Swap");
+		if (!headless) glutSwapBuffers();
+		else glFlush();	// submit the frame like a swap would
+	}
+	profiler().nextFrame();
+}
+
+void postRedisplay() { if (!headless) glutPostRedisplay(); }
+
+int elapsedTime() {
+	if (!headless) return glutGet(GLUT_ELAPSED_TIME);
+	if (benchmark) return (int)((long long)frameCount * 1000 / benchmarkFps);	// the same animation on every run
+	return (int)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - startTime).count();
+}
+
+bool isHeadless() { return headless; }
+
+static void displayFrame() {	// onDisplay with the per frame work of the framework
+	textureStreamer().update();
+	onDisplay();
+}
+
+static void startProfiler() {	// with a current context
+	if (!profile && !profileOutput) return;
+	profiler().capture = (profileOutput != nullptr);
+	profiler().startProfiling();
+}
+
+static void writeProfile() {	// at exit, the frames still in flight are not included in GLUT mode
+	if (profileOutput && profiler().write(profileOutput)) printf("Profile written to %s\n", profileOutput);
+}
+
+static void onSpecialKey(int key, int pX, int pY) {
+	if (key == GLUT_KEY_F3) profiler().overlay = !profiler().overlay;
+}
+
+#if !defined(__APPLE__)
+static void onClose() {	// the window is closed, its context is still current
+	onExit();
+	profiler().release();
+}
+#endif
+
+static void printGLInfo() {
+	int majorVersion, minorVersion;
+	printf("GL Vendor    : %s\n", glGetString(GL_VENDOR));
+	printf("GL Renderer  : %s\n", glGetString(GL_RENDERER));
+	printf("GL Version (string)  : %s\n", glGetString(GL_VERSION));
+	glGetIntegerv(GL_MAJOR_VERSION, &majorVersion);
+	glGetIntegerv(GL_MINOR_VERSION, &minorVersion);
+	printf("GL Version (integer) : %d.%d\n", majorVersion, minorVersion);
+	printf("GLSL Version : %s\n", glGetString(GL_SHADING_LANGUAGE_VERSION));
+}
+
+static void writeFrame(int frame) {	// current framebuffer to a 24 bit bmp file
+	int rowSize = (windowWidth * 3 + 3) & ~3;					// bmp rows are padded to 4 bytes like GL_PACK_ALIGNMENT 4
+	std::vector<unsigned char> pixels(rowSize * windowHeight);
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	glReadPixels(0, 0, windowWidth, windowHeight, GL_BGR, GL_UNSIGNED_BYTE, &pixels[0]);	// bottom-up, as in bmp
+	unsigned char header[54] = { 'B', 'M' };
+	unsigned int fileSize = 54 + (unsigned int)pixels.size(), fields[] = { fileSize, 0, 54, 40, windowWidth, windowHeight };
+	for (int i = 0; i < 6; i++) for (int b = 0; b < 4; b++) header[2 + 4 * i + b] = (unsigned char)(fields[i] >> (8 * b));
+	header[26] = 1;												// planes
+	header[28] = 24;											// bits per pixel
+	std::string pathname = std::string(dumpPrefix) + std::to_string(frame) + ".bmp";
+	FILE* file = fopen(pathname.c_str(), "wb");
+	if (!file) {
+		printf("%s cannot be written\n", pathname.c_str());
+		return;
+	}
+	fwrite(header, 1, sizeof(header), file);
+	fwrite(&pixels[0], 1, pixels.size(), file);
+	fclose(file);
+}
+
+struct FrameTimes {	// distribution of frame times in milliseconds
+	std::vector<double> samples;
+
+	double percentile(std::vector<double>& sorted, double p) {
+		if (sorted.empty()) return 0;
+		size_t i = (size_t)(p / 100 * (sorted.size() - 1) + 0.5);
+		return sorted[i];
+	}
+
+	void write(FILE* file, const char* name, bool last) {
+		std::vector<double> sorted = samples;
+		std::sort(sorted.begin(), sorted.end());
+		double sum = 0;
+		for (double ms : sorted) sum += ms;
+		fprintf(file, "  \"%s\": { \"mean\": %.4f, \"p50\": %.4f, \"p95\": %.4f, \"p99\": %.4f, \"min\": %.4f, \"max\": %.4f }%s\n",
+			name, sorted.empty() ? 0 : sum / sorted.size(), percentile(sorted, 50), percentile(sorted, 95), percentile(sorted, 99),
+			sorted.empty() ? 0 : sorted.front(), sorted.empty() ? 0 : sorted.back(), last ? "" : ",");
+	}
+};
+
+static std::string jsonString(const char* text) {
+	std::string result = "\"";
+	for (const char* c = text ? text : ""; *c; c++) {
+		if (*c == '"' || *c == '\\') result += '\\';
+		if ((unsigned char)*c >= 0x20) result += *c;
+	}
+	return result + "\"";
+}
+
+static void writeBenchmark(const char* program, FrameTimes& cpu, FrameTimes& gpu) {
+	FILE* file = benchmarkOutput ? fopen(benchmarkOutput, "w") : benchmarkStdout;
+	if (!file) {
+		printf("%s cannot be written\n", benchmarkOutput);
+		return;
+	}
+	fprintf(file, "{\n");
+	fprintf(file, "  \"program\": %s,\n", jsonString(program).c_str());
+	fprintf(file, "  \"renderer\": %s,\n", jsonString((const char*)glGetString(GL_RENDERER)).c_str());
+	fprintf(file, "  \"version\": %s,\n", jsonString((const char*)glGetString(GL_VERSION)).c_str());
+	fprintf(file, "  \"width\": %u, \"height\": %u, \"frames\": %d, \"warmup\": %d, \"fps\": %d,\n",
+		windowWidth, windowHeight, (int)cpu.samples.size(), benchmarkWarmup, benchmarkFps);
+	cpu.write(file, "cpu_ms", false);
+	gpu.write(file, "gpu_ms", true);
+	fprintf(file, "}\n");
+	fclose(file);
+}
+
+#if defined(HEADLESS_SUPPORTED)
+static int runHeadless(const char* program) {
+	EGLDisplay display = EGL_NO_DISPLAY;
+	const char* clientExtensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+	if (clientExtensions && strstr(clientExtensions, "EGL_MESA_platform_surfaceless")) {	// no window system at all
+		PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+		if (getPlatformDisplay) display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+	}
+	if (display == EGL_NO_DISPLAY) display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+	if (display == EGL_NO_DISPLAY || !eglInitialize(display, nullptr, nullptr)) {
+		printf("Error in EGL initialization\n");
+		return 1;
+	}
+	eglBindAPI(EGL_OPENGL_API);
+	EGLint configAttributes[] = { EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+	EGLConfig config = nullptr;
+	EGLint nConfigs = 0;
+	eglChooseConfig(display, configAttributes, &config, 1, &nConfigs);
+	EGLint contextAttributes[] = { EGL_CONTEXT_MAJOR_VERSION, 3, EGL_CONTEXT_MINOR_VERSION, 3,
+		EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT, EGL_NONE };
+	EGLContext context = eglCreateContext(display, (nConfigs > 0) ? config : (EGLConfig)0, EGL_NO_CONTEXT, contextAttributes);
+	if (context == EGL_NO_CONTEXT || !eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) {
+		printf("Error in EGL context creation\n");
+		return 1;
+	}
+
+	glewExperimental = true;	// magic
+	glewInit();
+	printGLInfo();
+
+	// The framebuffer object replaces the window, it stays bound for the whole run
+	unsigned int fbo, renderbuffers[2];
+	glGenFramebuffers(1, &fbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+	glGenRenderbuffers(2, renderbuffers);
+	glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[0]);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, windowWidth, windowHeight);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, renderbuffers[0]);
+	glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[1]);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, windowWidth, windowHeight);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, renderbuffers[1]);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+		printf("Error in offscreen framebuffer creation\n");
+		return 1;
+	}
+	glViewport(0, 0, windowWidth, windowHeight);
+
+	onInitialization();
+	startProfiler();
+
+	// In benchmark mode the CPU time of onIdle + onDisplay is measured on the clock, the GPU time with timer queries.
+	// Query results are read a few frames later, when they are already available.
+	const int nQueries = 4;
+	unsigned int queries[nQueries];
+	FrameTimes cpuTimes, gpuTimes;
+	if (benchmark) glGenQueries(nQueries, queries);
+	auto readQuery = [&](int frame) {
+		GLuint64 ns = 0;
+		glGetQueryObjectui64v(queries[frame % nQueries], GL_QUERY_RESULT, &ns);
+		if (frame >= benchmarkWarmup) gpuTimes.samples.push_back(ns / 1e6);
+	};
+
+	std::chrono::steady_clock::time_point renderStart = std::chrono::steady_clock::now();
+	for (frameCount = 0; frameCount < headlessFrames; frameCount++) {
+		if (benchmark && frameCount >= nQueries) readQuery(frameCount - nQueries);
+		std::chrono::steady_clock::time_point frameStart = std::chrono::steady_clock::now();
+		if (benchmark) glBeginQuery(GL_TIME_ELAPSED, queries[frameCount % nQueries]);
+		onIdle();
+		displayFrame();
+		if (benchmark) {
+			glEndQuery(GL_TIME_ELAPSED);
+			double cpuMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - frameStart).count();
+			if (frameCount >= benchmarkWarmup) cpuTimes.samples.push_back(cpuMs);
+		}
+		if (dumpPrefix) writeFrame(frameCount);
+	}
+	glFinish();
+	double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - renderStart).count();
+	printf("%d frames rendered headless in %.1f ms (%.3f ms/frame)\n", headlessFrames, ms, ms / headlessFrames);
+	if (benchmark) {
+		for (int frame = (headlessFrames > nQueries) ? headlessFrames - nQueries : 0; frame < headlessFrames; frame++) readQuery(frame);
+		glDeleteQueries(nQueries, queries);
+		writeBenchmark(program, cpuTimes, gpuTimes);
+	}
+	profiler().finish();
+	writeProfile();
+	onExit();
+	profiler().release();
+
+	glDeleteRenderbuffers(2, renderbuffers);
+	glDeleteFramebuffers(1, &fbo);
+	eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+	eglDestroyContext(display, context);
+	eglTerminate(display);
+	return 0;
+}
+#endif
+
 // Entry point of the application
+//   --headless       render to an offscreen framebuffer through EGL, no window or display is needed
+//   --frames=N       number of frames rendered in headless mode
+//   --dump=PREFIX    write the headless frames to PREFIX<frame>.bmp
+//   --benchmark=N    render N headless frames on a deterministic 60 fps clock and report the CPU and GPU frame times as JSON
+//   --benchmark-out=FILE  write the benchmark report to FILE instead of stdout
+//   --profile        time the scopes on the CPU and the GPU and show them over the frame, F3 toggles the overlay
+//   --profile-out=FILE  write every profiled scope to FILE, as Chrome trace JSON if it ends with .json, CSV otherwise
 int main(int argc, char * argv[]) {
+	for (int i = 1; i < argc; i++) {
+		std::string arg(argv[i]);
+		if (arg == "--headless") headless = true;
+		else if (arg.compare(0, 9, "--frames=") == 0) headlessFrames = atoi(arg.c_str() + 9);
+		else if (arg.compare(0, 7, "--dump=") == 0) dumpPrefix = argv[i] + 7;
+		else if (arg.compare(0, 12, "--benchmark=") == 0) { benchmark = headless = true; headlessFrames = benchmarkWarmup + atoi(arg.c_str() + 12); }
+		else if (arg.compare(0, 16, "--benchmark-out=") == 0) benchmarkOutput = argv[i] + 16;
+		else if (arg == "--no-shader-cache") GPUProgram::binaryCacheDirectory().clear();
+		else if (arg == "--profile") profile = true;
+		else if (arg.compare(0, 14, "--profile-out=") == 0) profileOutput = argv[i] + 14;
+	}
+	if (headless) {
+#if defined(HEADLESS_SUPPORTED)
+		if (benchmark && !benchmarkOutput) {	// stdout is kept for the JSON report alone, so that it can be piped
+			fflush(stdout);
+			benchmarkStdout = fdopen(dup(fileno(stdout)), "w");
+			if (benchmarkStdout) dup2(fileno(stderr), fileno(stdout));
+			else benchmarkStdout = stdout;
+		}
+		return runHeadless(argv[0]);
+#else
+		printf("Headless mode is not supported on this platform\n");
+		return 1;
+#endif
+	}
+
 	// Initialize GLUT, Glew and OpenGL 
 	glutInit(&argc, argv);
 
@@ -49,23 +331,23 @@ int main(int argc, char * argv[]) {
 	glewExperimental = true;	// magic
 	glewInit();
 #endif
-	printf("GL Vendor    : %s\n", glGetString(GL_VENDOR));
-	printf("GL Renderer  : %s\n", glGetString(GL_RENDERER));
-	printf("GL Version (string)  : %s\n", glGetString(GL_VERSION));
-	glGetIntegerv(GL_MAJOR_VERSION, &majorVersion);
-	glGetIntegerv(GL_MINOR_VERSION, &minorVersion);
-	printf("GL Version (integer) : %d.%d\n", majorVersion, minorVersion);
-	printf("GLSL Version : %s\n", glGetString(GL_SHADING_LANGUAGE_VERSION));
+	printGLInfo();
 
 	// Initialize this program and create shaders
 	onInitialization();
+	startProfiler();
+	atexit(writeProfile);	// glutMainLoop does not return
 
-	glutDisplayFunc(onDisplay);                // Register event handlers
+	glutDisplayFunc(displayFrame);             // Register event handlers
 	glutMouseFunc(onMouse);
 	glutIdleFunc(onIdle);
 	glutKeyboardFunc(onKeyboard);
 	glutKeyboardUpFunc(onKeyboardUp);
+	glutSpecialFunc(onSpecialKey);
 	glutMotionFunc(onMouseMotion);
+#if !defined(__APPLE__)
+	glutCloseFunc(onClose);	// freeglut makes the window current and exits after it
+#endif
 
 	glutMainLoop();
 	return 1;
@@ -9,8 +9,37 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <string.h>
+#include <ctype.h>
 #include <vector>
 #include <string>
+#include <unordered_map>
+#include <deque>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <chrono>
+#include <algorithm>
+#include <new>
+#include <type_traits>
+
+// vec4 and mat4 use SSE2 on x86 unless FRAMEWORK_NO_SIMD is defined, otherwise they fall back to scalar code
+#if !defined(FRAMEWORK_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define FRAMEWORK_SSE
+#include <emmintrin.h>	// SSE2, it includes the SSE header
+#endif
+
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__)
+#include <direct.h>		// _mkdir
+#include <process.h>	// _getpid
+#else
+#include <sys/stat.h>	// mkdir, on Apple too
+#include <unistd.h>		// getpid
+#endif
 
 #if defined(__APPLE__)
 #include <GLUT/GLUT.h>
@@ -26,6 +55,12 @@
 // Resolution of screen
 const unsigned int windowWidth = 600, windowHeight = 600;
 
+// Main loop services of framework.cpp, they work both with a GLUT window and in headless mode
+void swapBuffers();		// instead of glutSwapBuffers
+void postRedisplay();	// instead of glutPostRedisplay
+int elapsedTime();		// milliseconds since the start, instead of glutGet(GLUT_ELAPSED_TIME)
+bool isHeadless();		// rendering offscreen, see main in framework.cpp
+
 //--------------------------
 struct vec2 {
 //--------------------------
@@ -79,7 +114,7 @@ inline vec3 cross(const vec3& v1, const vec3& v2) {
 inline vec3 operator*(float a, const vec3& v) { return vec3(v.x * a, v.y * a, v.z * a); }
 
 //--------------------------
-struct vec4 {
+struct alignas(16) vec4 {	// aligned to fit an SSE register
 //--------------------------
 	float x, y, z, w;
 
@@ -87,12 +122,24 @@ struct vec4 {
 	float& operator[](int j) { return *(&x + j); }
 	float operator[](int j) const { return *(&x + j); }
 
+#ifdef FRAMEWORK_SSE
+	explicit vec4(__m128 v) { _mm_store_ps(&x, v); }
+	__m128 m128() const { return _mm_load_ps(&x); }
+
+	vec4 operator*(float a) const { return vec4(_mm_mul_ps(m128(), _mm_set1_ps(a))); }
+	vec4 operator/(float d) const { return vec4(_mm_div_ps(m128(), _mm_set1_ps(d))); }
+	vec4 operator+(const vec4& v) const { return vec4(_mm_add_ps(m128(), v.m128())); }
+	vec4 operator-(const vec4& v)  const { return vec4(_mm_sub_ps(m128(), v.m128())); }
+	vec4 operator*(const vec4& v) const { return vec4(_mm_mul_ps(m128(), v.m128())); }
+	void operator+=(const vec4 right) { _mm_store_ps(&x, _mm_add_ps(m128(), right.m128())); }
+#else
 	vec4 operator*(float a) const { return vec4(x * a, y * a, z * a, w * a); }
 	vec4 operator/(float d) const { return vec4(x / d, y / d, z / d, w / d); }
 	vec4 operator+(const vec4& v) const { return vec4(x + v.x, y + v.y, z + v.z, w + v.w); }
 	vec4 operator-(const vec4& v)  const { return vec4(x - v.x, y - v.y, z - v.z, w - v.w); }
 	vec4 operator*(const vec4& v) const { return vec4(x * v.x, y * v.y, z * v.z, w * v.w); }
 	void operator+=(const vec4 right) { x += right.x; y += right.y; z += right.z; w += right.w; }
+#endif
 };
 
 inline float dot(const vec4& v1, const vec4& v2) {
@@ -127,16 +174,49 @@ public:
 	operator float*() const { return (float*)this; }
 };
 
+#ifdef FRAMEWORK_SSE
+inline __m128 rowTimesMatrix(__m128 x, __m128 y, __m128 z, __m128 w, __m128 r0, __m128 r1, __m128 r2, __m128 r3) {
+	return _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, r0), _mm_mul_ps(y, r1)), _mm_add_ps(_mm_mul_ps(z, r2), _mm_mul_ps(w, r3)));
+}
+#endif
+
 inline vec4 operator*(const vec4& v, const mat4& mat) {
+#ifdef FRAMEWORK_SSE
+	return vec4(rowTimesMatrix(_mm_set1_ps(v.x), _mm_set1_ps(v.y), _mm_set1_ps(v.z), _mm_set1_ps(v.w),
+		mat.rows[0].m128(), mat.rows[1].m128(), mat.rows[2].m128(), mat.rows[3].m128()));
+#else
 	return v[0] * mat[0] + v[1] * mat[1] + v[2] * mat[2] + v[3] * mat[3];
+#endif
 }
 
 inline mat4 operator*(const mat4& left, const mat4& right) {
 	mat4 result;
+#ifdef FRAMEWORK_SSE
+	__m128 r0 = right.rows[0].m128(), r1 = right.rows[1].m128(), r2 = right.rows[2].m128(), r3 = right.rows[3].m128();
+	for (int i = 0; i < 4; i++) {	// the rows of right stay in registers
+		const vec4& l = left.rows[i];
+		result.rows[i] = vec4(rowTimesMatrix(_mm_set1_ps(l.x), _mm_set1_ps(l.y), _mm_set1_ps(l.z), _mm_set1_ps(l.w), r0, r1, r2, r3));
+	}
+#else
 	for (int i = 0; i < 4; i++) result.rows[i] = left.rows[i] * right;
+#endif
 	return result;
 }
 
+// result[i] = vec4(points[i], 1) * M for a whole array, result may not overlap points
+inline void transformPoints(const mat4& M, const vec3* points, vec4* result, size_t n) {
+#ifdef FRAMEWORK_SSE
+	__m128 r0 = M.rows[0].m128(), r1 = M.rows[1].m128(), r2 = M.rows[2].m128(), r3 = M.rows[3].m128();
+	for (size_t i = 0; i < n; i++) {
+		__m128 p = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(points[i].x), r0), _mm_mul_ps(_mm_set1_ps(points[i].y), r1)),
+			_mm_add_ps(_mm_mul_ps(_mm_set1_ps(points[i].z), r2), r3));
+		_mm_store_ps(&result[i].x, p);
+	}
+#else
+	for (size_t i = 0; i < n; i++) result[i] = points[i].x * M.rows[0] + points[i].y * M.rows[1] + points[i].z * M.rows[2] + M.rows[3];
+#endif
+}
+
 inline mat4 TranslateMatrix(vec3 t) {
 	return mat4(vec4(1,   0,   0,   0),
 			    vec4(0,   1,   0,   0),
@@ -151,47 +231,179 @@ inline mat4 ScaleMatrix(vec3 s) {
 				vec4(0,   0,   0,   1));
 }
 
-inline mat4 RotationMatrix(float angle, vec3 w) {
-	float c = cosf(angle), s = sinf(angle);
-	w = normalize(w);
+inline mat4 RotationMatrix(float c, float s, vec3 w) {	// cosine and sine of the angle are given, w has to be unit length
 	return mat4(vec4(c * (1 - w.x*w.x) + w.x*w.x, w.x*w.y*(1 - c) + w.z*s, w.x*w.z*(1 - c) - w.y*s, 0),
 			    vec4(w.x*w.y*(1 - c) - w.z*s, c * (1 - w.y*w.y) + w.y*w.y, w.y*w.z*(1 - c) + w.x*s, 0),
 			    vec4(w.x*w.z*(1 - c) + w.y*s, w.y*w.z*(1 - c) - w.x*s, c * (1 - w.z*w.z) + w.z*w.z, 0),
 			    vec4(0, 0, 0, 1));
 }
 
+inline mat4 RotationMatrix(float angle, vec3 w) {
+	return RotationMatrix(cosf(angle), sinf(angle), normalize(w));
+}
+
+//---------------------------
+struct mat3 { // row-major matrix 3x3, for normals
+//---------------------------
+	vec3 rows[3];
+public:
+	mat3() {}
+	mat3(vec3 it, vec3 jt, vec3 kt) {
+		rows[0] = it; rows[1] = jt; rows[2] = kt;
+	}
+
+	vec3& operator[](int i) { return rows[i]; }
+	vec3 operator[](int i) const { return rows[i]; }
+	operator float*() const { return (float*)this; }
+};
+
+inline vec3 operator*(const vec3& v, const mat3& mat) {
+	return v.x * mat[0] + v.y * mat[1] + v.z * mat[2];
+}
+
+// The inverse of the upper 3x3 block A of an affine matrix, with rows r0, r1, r2, is the transpose of the adjugate
+// divided by det(A). The rows of the transposed inverse are cross(r1, r2), cross(r2, r0), cross(r0, r1) over det(A).
+#ifdef FRAMEWORK_SSE
+inline __m128 cross(__m128 a, __m128 b) {	// w is 0 for finite inputs
+	__m128 aYZX = _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 0, 2, 1)), bYZX = _mm_shuffle_ps(b, b, _MM_SHUFFLE(3, 0, 2, 1));
+	__m128 c = _mm_sub_ps(_mm_mul_ps(a, bYZX), _mm_mul_ps(aYZX, b));
+	return _mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 0, 2, 1));
+}
+
+inline void inverseTransposeRows(const mat4& m, __m128& c0, __m128& c1, __m128& c2) {	// of the upper 3x3 block
+	__m128 mask = _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1));	// ignore the 4th column
+	__m128 r0 = _mm_and_ps(m.rows[0].m128(), mask), r1 = _mm_and_ps(m.rows[1].m128(), mask), r2 = _mm_and_ps(m.rows[2].m128(), mask);
+	c0 = cross(r1, r2); c1 = cross(r2, r0); c2 = cross(r0, r1);
+	__m128 det = _mm_mul_ps(r0, c0);
+	det = _mm_add_ps(det, _mm_shuffle_ps(det, det, _MM_SHUFFLE(2, 3, 0, 1)));
+	det = _mm_add_ps(det, _mm_shuffle_ps(det, det, _MM_SHUFFLE(1, 0, 3, 2)));	// in all lanes
+	__m128 invDet = _mm_div_ps(_mm_set1_ps(1), det);
+	c0 = _mm_mul_ps(c0, invDet); c1 = _mm_mul_ps(c1, invDet); c2 = _mm_mul_ps(c2, invDet);
+}
+#endif
+
+// Inverse of a matrix whose last column is (0, 0, 0, 1), that is any combination of scaling, rotation, shear and translation
+inline mat4 AffineInverse(const mat4& m) {
+#ifdef FRAMEWORK_SSE
+	__m128 c0, c1, c2, c3 = _mm_setzero_ps();
+	inverseTransposeRows(m, c0, c1, c2);
+	_MM_TRANSPOSE4_PS(c0, c1, c2, c3);
+	__m128 t = rowTimesMatrix(_mm_set1_ps(-m.rows[3].x), _mm_set1_ps(-m.rows[3].y), _mm_set1_ps(-m.rows[3].z), _mm_set1_ps(1),
+		c0, c1, c2, _mm_setr_ps(0, 0, 0, 1));
+	return mat4(vec4(c0), vec4(c1), vec4(c2), vec4(t));
+#else
+	vec3 r0(m[0].x, m[0].y, m[0].z), r1(m[1].x, m[1].y, m[1].z), r2(m[2].x, m[2].y, m[2].z);
+	vec3 c0 = cross(r1, r2), c1 = cross(r2, r0), c2 = cross(r0, r1);
+	float invDet = 1 / dot(r0, c0);
+	c0 = c0 * invDet; c1 = c1 * invDet; c2 = c2 * invDet;
+	mat4 inv(c0.x, c1.x, c2.x, 0,
+			 c0.y, c1.y, c2.y, 0,
+			 c0.z, c1.z, c2.z, 0,
+			 0, 0, 0, 1);
+	inv[3] = vec4(-m[3].x, -m[3].y, -m[3].z, 1) * inv;
+	return inv;
+#endif
+}
+
+// Transforms normals as n * NormalMatrix(M) when points are transformed by M, the inverse transpose of the upper 3x3 block
+inline mat3 NormalMatrix(const mat4& m) {
+#ifdef FRAMEWORK_SSE
+	vec4 c0, c1, c2;
+	__m128 s0, s1, s2;
+	inverseTransposeRows(m, s0, s1, s2);
+	c0 = vec4(s0); c1 = vec4(s1); c2 = vec4(s2);
+	return mat3(vec3(c0.x, c0.y, c0.z), vec3(c1.x, c1.y, c1.z), vec3(c2.x, c2.y, c2.z));
+#else
+	vec3 r0(m[0].x, m[0].y, m[0].z), r1(m[1].x, m[1].y, m[1].z), r2(m[2].x, m[2].y, m[2].z);
+	vec3 c0 = cross(r1, r2), c1 = cross(r2, r0), c2 = cross(r0, r1);
+	float invDet = 1 / dot(r0, c0);
+	return mat3(c0 * invDet, c1 * invDet, c2 * invDet);
+#endif
+}
+
 //---------------------------
 class Texture {
 //---------------------------
-	std::vector<vec4> load(std::string pathname, bool transparent, int& width, int& height) {
-		FILE * file = fopen(pathname.c_str(), "r");
+	static unsigned int readLE(const unsigned char* p, int bytes) {	// little endian field of the header
+		unsigned int value = 0;
+		for (int i = bytes - 1; i >= 0; i--) value = (value << 8) | p[i];
+		return value;
+	}
+
+public:
+	unsigned int textureId = 0;
+
+	// Reads an uncompressed 24 or 32 bit BMP into 8 bit RGBA texels, the bottom row first as glTexImage2D expects.
+	// The pixels are streamed a few rows at a time, so only the result is kept in memory. It does not use OpenGL,
+	// any thread may call it.
+	static bool load(const std::string& pathname, bool transparent, int& width, int& height, std::vector<unsigned char>& image) {
+		width = height = 0;
+		FILE * file = fopen(pathname.c_str(), "rb");
 		if (!file) {
 			printf("%s does not exist\n", pathname.c_str());
+			return false;
+		}
+		unsigned char header[54];		// file header and the common part of all info header versions
+		if (fread(header, 1, 54, file) != 54 || readLE(header, 2) != 0x4D42) {
+			printf("Not bmp file\n");
+			fclose(file);
+			return false;
+		}
+		unsigned int pixelOffset = readLE(header + 10, 4);
+		int bmpHeight = (int)readLE(header + 22, 4);	// negative for top-down images
+		int bitsPerPixel = readLE(header + 28, 2), compression = readLE(header + 30, 4);
+		width = (int)readLE(header + 18, 4);
+		const int maxSize = 16384;	// the header is not trusted before the allocations, GL limits are not known off the GL thread
+		if (width <= 0 || width > maxSize || bmpHeight == 0 || bmpHeight < -maxSize || bmpHeight > maxSize || pixelOffset < 54) {
+			printf("Not bmp file\n");
+			fclose(file);
+			width = 0;
+			return false;
+		}
+		height = (bmpHeight < 0) ? -bmpHeight : bmpHeight;
+		// 32 bit images with bitfields are read in the usual BGRA order
+		if ((bitsPerPixel != 24 && bitsPerPixel != 32) || (compression != 0 && !(compression == 3 && bitsPerPixel == 32))) {
+			printf("Only true color bmp files are supported\n");
+			fclose(file);
 			width = height = 0;
-			return std::vector<vec4>();
-		}
-		unsigned short bitmapFileHeader[27];					// bitmap header
-		fread(&bitmapFileHeader, 27, 2, file);
-		if (bitmapFileHeader[0] != 0x4D42) printf("Not bmp file\n");
-		if (bitmapFileHeader[14] != 24) printf("Only true color bmp files are supported\n");
-		width = bitmapFileHeader[9];
-		height = bitmapFileHeader[11];
-		unsigned int size = (unsigned long)bitmapFileHeader[17] + (unsigned long)bitmapFileHeader[18] * 65536;
-		fseek(file, 54, SEEK_SET);
-		std::vector<unsigned char> bImage(size);
-		fread(&bImage[0], 1, size, file); 	// read the pixels
-		fclose(file);
-		std::vector<vec4> image(width * height);
-		int i = 0;
-		for (unsigned int idx = 0; idx < size; idx += 3) { // Swap R and B since in BMP, the order is BGR
-			float alpha = (transparent) ? (bImage[idx] + bImage[idx + 1] + bImage[idx + 2]) / 3.0f / 256.0f : 1.0f;
-			image[i++] = vec4(bImage[idx + 2] / 256.0f, bImage[idx + 1] / 256.0f, bImage[idx] / 256.0f, alpha);
+			return false;
+		}
+		int bytesPerPixel = bitsPerPixel / 8;
+		size_t stride = ((size_t)width * bytesPerPixel + 3) & ~(size_t)3;	// rows are padded to 4 bytes
+		fseek(file, 0, SEEK_END);
+		long fileSize = ftell(file);
+		if (fileSize < 0 || pixelOffset + stride * height > (size_t)fileSize) {
+			printf("%s is truncated\n", pathname.c_str());
+			fclose(file);
+			width = height = 0;
+			return false;
 		}
-		return image;
+		int chunkRows = (int)(65536 / stride) + 1;
+		std::vector<unsigned char> chunk(stride * chunkRows);
+		image.resize((size_t)width * height * 4);
+		fseek(file, pixelOffset, SEEK_SET);
+		for (int row = 0; row < height; row += chunkRows) {
+			int rows = (height - row < chunkRows) ? height - row : chunkRows;
+			if (fread(&chunk[0], stride, rows, file) != (size_t)rows) {
+				printf("%s is truncated\n", pathname.c_str());
+				fclose(file);
+				width = height = 0;
+				return false;
+			}
+			for (int r = 0; r < rows; r++) {
+				int y = (bmpHeight < 0) ? height - 1 - (row + r) : row + r;
+				const unsigned char* src = &chunk[r * stride];
+				unsigned char* dst = &image[(size_t)y * width * 4];
+				for (int x = 0; x < width; x++, src += bytesPerPixel, dst += 4) {	// BGR(A) to RGBA
+					dst[0] = src[2]; dst[1] = src[1]; dst[2] = src[0];
+					dst[3] = (transparent) ? (unsigned char)((src[0] + src[1] + src[2]) / 3) : 255;
+				}
+			}
+		}
+		fclose(file);
+		return true;
 	}
 
-public:
-	unsigned int textureId = 0;
 
 	Texture() { textureId = 0; }
 
@@ -215,8 +427,22 @@ public:
 
 	void create(std::string pathname, bool transparent = false) {
 		int width, height;
-		std::vector<vec4> image = load(pathname, transparent, width, height);
-		if (image.size() > 0) create(width, height, image);
+		std::vector<unsigned char> image;
+		if (load(pathname, transparent, width, height, image)) create(width, height, image);
+	}
+
+	void create(int width, int height, const std::vector<unsigned char>& image, int sampling = GL_LINEAR) {	// 8 bit RGBA texels
+		create(width, height, &image[0], sampling);
+	}
+
+	// texels is an offset into the buffer if a GL_PIXEL_UNPACK_BUFFER is bound
+	void create(int width, int height, const unsigned char* texels, int sampling = GL_LINEAR) {
+		if (textureId == 0) glGenTextures(1, &textureId);
+		glBindTexture(GL_TEXTURE_2D, textureId);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);		// rows of RGBA texels are always aligned
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, texels);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, sampling);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, sampling);
 	}
 
 	void create(int width, int height, const std::vector<vec4>& image, int sampling = GL_LINEAR) {
@@ -233,55 +459,258 @@ public:
 	}
 };
 
+//---------------------------
+class GLState {	// shadow copy of some GL bindings, calls that would not change them are skipped
+//---------------------------
+	static const unsigned int unknown = 0xFFFFFFFF;
+	static const int maxUniformBuffers = 16;
+	unsigned int program = unknown, vertexArray = unknown;
+	unsigned int uniformBuffers[maxUniformBuffers];
+public:
+	unsigned int calls = 0, skipped = 0;	// statistics of the calls through this object
+
+	GLState() { invalidate(); }
+
+	// the next calls go to GL, after the bindings were changed directly or an object was deleted
+	void invalidate() {
+		program = vertexArray = unknown;
+		for (int i = 0; i < maxUniformBuffers; i++) uniformBuffers[i] = unknown;
+	}
+
+	void useProgram(unsigned int id) {
+		calls++;
+		if (id == program) { skipped++; return; }
+		glUseProgram(id);
+		program = id;
+	}
+
+	void bindVertexArray(unsigned int id) {
+		calls++;
+		if (id == vertexArray) { skipped++; return; }
+		glBindVertexArray(id);
+		vertexArray = id;
+	}
+
+	void bindUniformBuffer(unsigned int binding, unsigned int id) {	// glBindBufferBase of GL_UNIFORM_BUFFER
+		calls++;
+		if (binding < maxUniformBuffers && id == uniformBuffers[binding]) { skipped++; return; }
+		glBindBufferBase(GL_UNIFORM_BUFFER, binding, id);
+		if (binding < maxUniformBuffers) uniformBuffers[binding] = id;
+	}
+};
+
+inline GLState& glState() { // use it for the bindings it knows, or invalidate it after binding them directly
+	static GLState state;
+	return state;
+}
+
 //---------------------------
 class GPUProgram {
 //--------------------------
 	unsigned int shaderProgramId = 0;
 	unsigned int vertexShader = 0, geometryShader = 0, fragmentShader = 0;
 	bool waitError = true;
+	std::unordered_map<std::string, int> locations;	// uniform name -> location, filled at link time
+public:
+	enum Status { Empty, Compiling, Ready, Failed };
+
+	struct Diagnostic {	// error of a program that failed to build
+		std::string stage;	// "vertex", "geometry", "fragment" or "link"
+		std::string log;	// message of the driver
+	};
+private:
+	Status status = Empty;
+	bool hasGeometryShader = false;
+	unsigned long long saveBinaryKey = 0;	// cache key of a program being linked, 0 if it is not saved
+	std::vector<Diagnostic> diagnostics;
+
+	struct Sources {	// kept for the variants
+		std::string vertex, geometry, fragment, outputName;
+		bool hasGeometry = false;
+	} sources;
+	std::unordered_map<std::string, std::unique_ptr<GPUProgram>> variants;	// by their defines
+
+	// Program binary cache: <directory>/<key>.bin holds the header below and the binary of glGetProgramBinary.
+	// The key hashes the sources with the vendor, renderer and version of the driver, so a driver update misses.
+	struct BinaryHeader {
+		unsigned int magic;
+		unsigned int format;	// binary format of the driver
+		unsigned long long key;	// against collisions of the file name
+		unsigned int length;
+	};
+	static const unsigned int binaryMagic = 0x31425047;	// "GPB1"
+
+	static unsigned long long hash(unsigned long long h, const char* text) {	// FNV-1a, the terminating zero included
+		do { h = (h ^ (unsigned char)*text) * 1099511628211ull; } while (*text++);
+		return h;
+	}
 
-	void getErrorInfo(unsigned int handle) { // shader error report
-		int logLen, written;
-		glGetShaderiv(handle, GL_INFO_LOG_LENGTH, &logLen);
-		if (logLen > 0) {
-			std::string log(logLen, '\0');
-			glGetShaderInfoLog(handle, logLen, &written, &log[0]);
-			printf("Shader log:\n%s", log.c_str());
-			if (waitError) getchar();
-		}
+	static bool binariesSupported() {
+		int nFormats = 0;
+		glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &nFormats);	// 0 without ARB_get_program_binary
+		while (glGetError() != GL_NO_ERROR) { }
+		return nFormats > 0;
 	}
 
-	bool checkShader(unsigned int shader, std::string message) { // check if shader could be compiled
-		int OK;
-		glGetShaderiv(shader, GL_COMPILE_STATUS, &OK);
-		if (!OK) {
-			printf("%s!\n", message.c_str());
-			getErrorInfo(shader);
+	static std::string binaryPath(unsigned long long key) {
+		char name[32];
+		snprintf(name, sizeof(name), "/%016llx.bin", key);
+		return binaryCacheDirectory() + name;
+	}
+
+	bool loadBinary(unsigned long long key) {	// false if there is no usable entry, the caller compiles then
+		FILE* file = fopen(binaryPath(key).c_str(), "rb");
+		if (!file) return false;
+		BinaryHeader header;
+		std::vector<char> binary;
+		fseek(file, 0, SEEK_END);
+		long fileSize = ftell(file);	// a corrupt length must not size the allocation
+		fseek(file, 0, SEEK_SET);
+		bool ok = fread(&header, sizeof(header), 1, file) == 1 && header.magic == binaryMagic && header.key == key &&
+			fileSize >= 0 && (unsigned long)fileSize == sizeof(header) + (unsigned long)header.length;
+		if (ok) {
+			binary.resize(header.length);
+			ok = header.length > 0 && fread(&binary[0], 1, header.length, file) == header.length;
+		}
+		fclose(file);
+		if (!ok) return false;
+
+		shaderProgramId = glCreateProgram();
+		glProgramBinary(shaderProgramId, header.format, &binary[0], header.length);
+		int linked = 0;
+		glGetProgramiv(shaderProgramId, GL_LINK_STATUS, &linked);	// the driver may reject an old binary
+		if (!linked) {
+			glDeleteProgram(shaderProgramId);
+			glState().invalidate();	// the id may come back for another program
+			shaderProgramId = 0;
 			return false;
 		}
 		return true;
 	}
 
-	bool checkLinking(unsigned int program) { 	// check if shader could be linked
-		int OK;
-		glGetProgramiv(program, GL_LINK_STATUS, &OK);
-		if (!OK) {
-			printf("Failed to link shader program!\n");
-			getErrorInfo(program);
-			return false;
+	void saveBinary(unsigned long long key) {	// errors are ignored, the next run compiles again
+		BinaryHeader header = { binaryMagic, 0, key, 0 };
+		int length = 0;
+		glGetProgramiv(shaderProgramId, GL_PROGRAM_BINARY_LENGTH, &length);
+		if (length <= 0) return;
+		std::vector<char> binary(length);
+		GLenum format = 0;
+		glGetProgramBinary(shaderProgramId, length, &length, &format, &binary[0]);
+		header.format = format;
+		header.length = (unsigned int)length;
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__)
+		_mkdir(binaryCacheDirectory().c_str());
+		int pid = _getpid();
+#else
+		mkdir(binaryCacheDirectory().c_str(), 0755);
+		int pid = (int)getpid();
+#endif
+		// each process writes its own temporary file and renames it, other processes never see a partial file
+		std::string path = binaryPath(key), temporary = path + "." + std::to_string(pid) + ".tmp";
+		FILE* file = fopen(temporary.c_str(), "wb");
+		if (!file) return;
+		bool ok = fwrite(&header, sizeof(header), 1, file) == 1 && fwrite(&binary[0], 1, length, file) == (size_t)length;
+		ok = (fclose(file) == 0) && ok;
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__)
+		if (ok) remove(path.c_str());	// rename does not replace an existing file on Windows, it does atomically on POSIX
+#endif
+		if (!ok || rename(temporary.c_str(), path.c_str()) != 0) remove(temporary.c_str());
+	}
+
+	static std::string infoLog(unsigned int handle, bool program) {	// compiler or linker messages
+		int logLen = 0, written = 0;
+		if (program) glGetProgramiv(handle, GL_INFO_LOG_LENGTH, &logLen);
+		else glGetShaderiv(handle, GL_INFO_LOG_LENGTH, &logLen);
+		if (logLen <= 0) return std::string();
+		std::string log(logLen, '\0');
+		if (program) glGetProgramInfoLog(handle, logLen, &written, &log[0]);
+		else glGetShaderInfoLog(handle, logLen, &written, &log[0]);
+		log.resize(written);
+		return log;
+	}
+
+	static bool parallelCompileSupported() {	// GL_KHR_parallel_shader_compile, checked once
+		static int supported = -1;
+		if (supported < 0) {
+			supported = 0;
+#ifdef GL_COMPLETION_STATUS_KHR
+			int nExtensions = 0;
+			glGetIntegerv(GL_NUM_EXTENSIONS, &nExtensions);
+			for (int i = 0; i < nExtensions; i++) {
+				const char* extension = (const char*)glGetStringi(GL_EXTENSIONS, i);
+				if (extension && strcmp(extension, "GL_KHR_parallel_shader_compile") == 0) supported = 1;
+			}
+			if (supported) glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);	// as many threads as the driver wants
+#endif
 		}
-		return true;
+		return supported == 1;
+	}
+
+	void compileStage(unsigned int& shader, GLenum type, const char* source, const char* name) {	// no status query
+		if (shader == 0) shader = glCreateShader(type);
+		if (!shader) {
+			printf("Error in %s shader creation\n", name);
+			exit(1);
+		}
+		glShaderSource(shader, 1, (const GLchar**)&source, NULL);
+		glCompileShader(shader);
+	}
+
+	void finishLinking() {	// the driver is done, check the result
+		int linked = 0;
+		glGetProgramiv(shaderProgramId, GL_LINK_STATUS, &linked);
+		if (linked) {
+			if (saveBinaryKey != 0) saveBinary(saveBinaryKey);
+			cacheLocations();
+			status = Ready;
+			return;
+		}
+		const char* names[3] = { "vertex", "geometry", "fragment" };
+		unsigned int shaders[3] = { vertexShader, hasGeometryShader ? geometryShader : 0, fragmentShader };
+		for (int i = 0; i < 3; i++) {
+			if (shaders[i] == 0) continue;
+			int compiled = 0;
+			glGetShaderiv(shaders[i], GL_COMPILE_STATUS, &compiled);
+			if (!compiled) diagnostics.push_back(Diagnostic{ names[i], infoLog(shaders[i], false) });
+		}
+		if (diagnostics.empty()) diagnostics.push_back(Diagnostic{ "link", infoLog(shaderProgramId, true) });
+		status = Failed;
 	}
 
-	int getLocation(const std::string& name) {	// get the address of a GPU uniform variable
-		int location = glGetUniformLocation(shaderProgramId, name.c_str());
-		if (location < 0) printf("uniform %s cannot be set\n", name.c_str());
-		return location;
+	void cacheLocations() {	// query the location of every active uniform once, after linking
+		locations.clear();
+		int nUniforms = 0, maxLength = 0;
+		glGetProgramiv(shaderProgramId, GL_ACTIVE_UNIFORMS, &nUniforms);
+		glGetProgramiv(shaderProgramId, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+		std::string name(maxLength + 1, '\0');
+		for (int i = 0; i < nUniforms; i++) {
+			int length = 0, size = 0;
+			GLenum type;
+			glGetActiveUniform(shaderProgramId, i, (GLsizei)name.size(), &length, &size, &type, &name[0]);
+			std::string uniformName(name.c_str(), length);
+			int location = glGetUniformLocation(shaderProgramId, uniformName.c_str());
+			if (location < 0) continue;	// member of a uniform block
+			locations[uniformName] = location;
+			if (uniformName.size() > 3 && uniformName.compare(uniformName.size() - 3, 3, "[0]") == 0) {	// array elements
+				std::string base = uniformName.substr(0, uniformName.size() - 3);
+				locations[base] = location;
+				for (int j = 1; j < size; j++) {
+					std::string element = base + "[" + std::to_string(j) + "]";
+					locations[element] = glGetUniformLocation(shaderProgramId, element.c_str());
+				}
+			}
+		}
 	}
 
 public:
 	GPUProgram(bool _waitError = true) { shaderProgramId = 0; waitError = _waitError; }
 
+	// directory of the program binary cache, the empty string turns the cache off
+	static std::string& binaryCacheDirectory() {
+		static std::string directory = getenv("SHADER_CACHE_DIR") ? getenv("SHADER_CACHE_DIR") : "shader_cache";
+		return directory;
+	}
+
 	GPUProgram(const GPUProgram& program) {
 		if (program.shaderProgramId > 0) printf("\nError: GPU program is not copied on GPU!!!\n");
 	}
@@ -292,42 +721,94 @@ public:
 
 	unsigned int getId() { return shaderProgramId; }
 
-	bool create(const char * const vertexShaderSource,
-		        const char * const fragmentShaderSource, const char * const fragmentShaderOutputName,
-		        const char * const geometryShaderSource = nullptr)
-	{
-		// Create vertex shader from string
-		if (vertexShader == 0) vertexShader = glCreateShader(GL_VERTEX_SHADER);
-		if (!vertexShader) {
-			printf("Error in vertex shader creation\n");
-			exit(1);
+	int getLocation(const std::string& name) {	// get the address of a GPU uniform variable, resolve it once and keep the handle
+		auto it = locations.find(name);
+		if (it == locations.end()) {
+			printf("uniform %s cannot be set\n", name.c_str());
+			return -1;
 		}
-		glShaderSource(vertexShader, 1, (const GLchar**)&vertexShaderSource, NULL);
-		glCompileShader(vertexShader);
-		if (!checkShader(vertexShader, "Vertex shader error")) return false;
+		return it->second;
+	}
 
-		// Create geometry shader from string if given
-		if (geometryShaderSource != nullptr) {
-			if (geometryShader == 0) geometryShader = glCreateShader(GL_GEOMETRY_SHADER);
-			if (!geometryShader) {
-				printf("Error in geometry shader creation\n");
-				exit(1);
-			}
-			glShaderSource(geometryShader, 1, (const GLchar**)&geometryShaderSource, NULL);
-			glCompileShader(geometryShader);
-			if (!checkShader(geometryShader, "Geometry shader error")) return false;
+	void setUniformBlock(const std::string& blockName, unsigned int binding) {	// connect a uniform block to a buffer binding point
+		unsigned int blockIndex = glGetUniformBlockIndex(shaderProgramId, blockName.c_str());
+		if (blockIndex == GL_INVALID_INDEX) printf("uniform block %s cannot be set\n", blockName.c_str());
+		else glUniformBlockBinding(shaderProgramId, blockIndex, binding);
+	}
+
+	static std::string addDefines(const std::string& source, const std::string& defines) {	// after the #version line
+		std::string code(source);
+		size_t versionLine = code.find("#version");
+		size_t lineEnd = (versionLine == std::string::npos) ? std::string::npos : code.find('\n', versionLine);
+		return (lineEnd == std::string::npos) ? defines + code : code.insert(lineEnd + 1, defines);
+	}
+
+	// sources of the variants without building this program, create and createAsync also keep their sources
+	void setSources(const char * const vertexShaderSource,
+		const char * const fragmentShaderSource, const char * const fragmentShaderOutputName,
+		const char * const geometryShaderSource = nullptr)
+	{
+		Sources copy;
+		copy.vertex = vertexShaderSource;
+		copy.fragment = fragmentShaderSource;
+		copy.outputName = fragmentShaderOutputName;
+		copy.hasGeometry = geometryShaderSource != nullptr;
+		if (copy.hasGeometry) copy.geometry = geometryShaderSource;
+		sources = copy;
+		variants.clear();	// built from the old sources
+	}
+
+	// The program specialized by the defines: the sources of this program with the defines after their #version line.
+	// A variant is built at its first request, without waiting like createAsync, and later requests return the same
+	// program. Call finish on it before the first use.
+	GPUProgram& variant(const std::string& defines) {
+		std::unique_ptr<GPUProgram>& program = variants[defines];
+		if (!program) {
+			program.reset(new GPUProgram(waitError));
+			std::string vertex = addDefines(sources.vertex, defines), fragment = addDefines(sources.fragment, defines);
+			std::string geometry = sources.hasGeometry ? addDefines(sources.geometry, defines) : std::string();
+			program->createAsync(vertex.c_str(), fragment.c_str(), sources.outputName.c_str(), sources.hasGeometry ? geometry.c_str() : nullptr);
 		}
+		return *program;
+	}
 
-		// Create fragment shader from string
-		if (fragmentShader == 0) fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
-		if (!fragmentShader) {
-			printf("Error in fragment shader creation\n");
-			exit(1);
+	// Starts building the program and returns without waiting for the driver: no status is queried until getStatus,
+	// isReady or finish. Submitting many programs first and checking them later lets the driver compile them in
+	// parallel, with GL_KHR_parallel_shader_compile also on its own threads. Errors go to getDiagnostics.
+	void createAsync(const char * const vertexShaderSource,
+		const char * const fragmentShaderSource, const char * const fragmentShaderOutputName,
+		const char * const geometryShaderSource = nullptr)
+	{
+		setSources(vertexShaderSource, fragmentShaderSource, fragmentShaderOutputName, geometryShaderSource);
+		if (shaderProgramId > 0) {
+			glDeleteProgram(shaderProgramId);
+			glState().invalidate();
+		}
+		shaderProgramId = 0;
+		diagnostics.clear();
+		locations.clear();
+		saveBinaryKey = 0;
+		hasGeometryShader = geometryShaderSource != nullptr;
+		parallelCompileSupported();
+
+		// Look for a binary of the same sources linked by the same driver
+		bool useCache = !binaryCacheDirectory().empty() && binariesSupported();
+		if (useCache) {
+			unsigned long long key = 14695981039346656037ull;
+			const char* texts[] = { vertexShaderSource, geometryShaderSource ? geometryShaderSource : "", fragmentShaderSource, fragmentShaderOutputName,
+				(const char*)glGetString(GL_VENDOR), (const char*)glGetString(GL_RENDERER), (const char*)glGetString(GL_VERSION) };
+			for (const char* text : texts) key = hash(key, text ? text : "");
+			if (loadBinary(key)) {
+				cacheLocations();
+				status = Ready;
+				return;
+			}
+			saveBinaryKey = key;
 		}
 
-		glShaderSource(fragmentShader, 1, (const GLchar**)&fragmentShaderSource, NULL);
-		glCompileShader(fragmentShader);
-		if (!checkShader(fragmentShader, "Fragment shader error")) return false;
+		compileStage(vertexShader, GL_VERTEX_SHADER, vertexShaderSource, "vertex");
+		if (hasGeometryShader) compileStage(geometryShader, GL_GEOMETRY_SHADER, geometryShaderSource, "geometry");
+		compileStage(fragmentShader, GL_FRAGMENT_SHADER, fragmentShaderSource, "fragment");
 
 		shaderProgramId = glCreateProgram();
 		if (!shaderProgramId) {
@@ -336,62 +817,1051 @@ public:
 		}
 		glAttachShader(shaderProgramId, vertexShader);
 		glAttachShader(shaderProgramId, fragmentShader);
-		if (geometryShader > 0) glAttachShader(shaderProgramId, geometryShader);
+		if (hasGeometryShader) glAttachShader(shaderProgramId, geometryShader);
 
 		// Connect the fragmentColor to the frame buffer memory
 		glBindFragDataLocation(shaderProgramId, 0, fragmentShaderOutputName);	// this output goes to the frame buffer memory
 
-		// program packaging
+		// program packaging, a failed stage shows up as a failed link
+		if (useCache) glProgramParameteri(shaderProgramId, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
 		glLinkProgram(shaderProgramId);
-		if (!checkLinking(shaderProgramId)) return false;
+		status = Compiling;
+	}
+
+	Status getStatus() {	// does not block if the driver can report completion
+		if (status != Compiling) return status;
+#ifdef GL_COMPLETION_STATUS_KHR
+		if (parallelCompileSupported()) {
+			int completed = 0;
+			glGetProgramiv(shaderProgramId, GL_COMPLETION_STATUS_KHR, &completed);
+			if (!completed) return status;
+		}
+#endif
+		finishLinking();
+		return status;
+	}
+
+	bool isReady() { return getStatus() == Ready; }
+
+	bool finish() {	// waits for the program, true if it can be used
+		if (status == Compiling) finishLinking();
+		return status == Ready;
+	}
+
+	const std::vector<Diagnostic>& getDiagnostics() const { return diagnostics; }
+
+	bool create(const char * const vertexShaderSource,
+		        const char * const fragmentShaderSource, const char * const fragmentShaderOutputName,
+		        const char * const geometryShaderSource = nullptr)
+	{
+		createAsync(vertexShaderSource, fragmentShaderSource, fragmentShaderOutputName, geometryShaderSource);
+		if (!finish()) {
+			for (const Diagnostic& diagnostic : diagnostics) {
+				if (diagnostic.stage == "link") printf("Failed to link shader program!\n");
+				else printf("%c%s shader error!\n", toupper(diagnostic.stage[0]), diagnostic.stage.c_str() + 1);
+				printf("Shader log:\n%s", diagnostic.log.c_str());
+				if (waitError) getchar();
+			}
+			return false;
+		}
 
 		// make this program run
-		glUseProgram(shaderProgramId);
+		glState().useProgram(shaderProgramId);
 		return true;
 	}
 
 	void Use() { 		// make this program run
-		glUseProgram(shaderProgramId);
+		glState().useProgram(shaderProgramId);
 	}
 
-	void setUniform(int i, const std::string& name) {
-		int location = getLocation(name);
-		if (location >= 0) glUniform1i(location, i);
+	void setUniform(int i, const std::string& name) { setUniform(i, getLocation(name)); }
+	void setUniform(float f, const std::string& name) { setUniform(f, getLocation(name)); }
+	void setUniform(const vec2& v, const std::string& name) { setUniform(v, getLocation(name)); }
+	void setUniform(const vec3& v, const std::string& name) { setUniform(v, getLocation(name)); }
+	void setUniform(const vec4& v, const std::string& name) { setUniform(v, getLocation(name)); }
+	void setUniform(const mat4& mat, const std::string& name) { setUniform(mat, getLocation(name)); }
+	void setUniform(const mat3& mat, const std::string& name) { setUniform(mat, getLocation(name)); }
+
+	// handle based variants, the location comes from getLocation
+	void setUniform(int i, int location) { if (location >= 0) glUniform1i(location, i); }
+	void setUniform(float f, int location) { if (location >= 0) glUniform1f(location, f); }
+	void setUniform(const vec2& v, int location) { if (location >= 0) glUniform2fv(location, 1, &v.x); }
+	void setUniform(const vec3& v, int location) { if (location >= 0) glUniform3fv(location, 1, &v.x); }
+	void setUniform(const vec4& v, int location) { if (location >= 0) glUniform4fv(location, 1, &v.x); }
+	void setUniform(const mat4& mat, int location) { if (location >= 0) glUniformMatrix4fv(location, 1, GL_TRUE, mat); }
+	void setUniform(const mat3& mat, int location) { if (location >= 0) glUniformMatrix3fv(location, 1, GL_TRUE, mat); }
+
+	void setUniform(const Texture& texture, const std::string& samplerName, unsigned int textureUnit = 0) {
+		int location = getLocation(samplerName);
+		if (location >= 0) {
+			glUniform1i(location, textureUnit);
+			glActiveTexture(GL_TEXTURE0 + textureUnit);
+			glBindTexture(GL_TEXTURE_2D, texture.textureId);
+		}
 	}
 
-	void setUniform(float f, const std::string& name) {
-		int location = getLocation(name);
-		if (location >= 0) glUniform1f(location, f);
+	void release() {	// the program, its shaders and variants, while the context is current
+		variants.clear();
+		if (shaderProgramId > 0) {
+			glDeleteProgram(shaderProgramId);
+			glState().invalidate();
+		}
+		for (unsigned int* shader : { &vertexShader, &geometryShader, &fragmentShader }) {
+			if (*shader > 0) glDeleteShader(*shader);
+			*shader = 0;
+		}
+		shaderProgramId = 0;
+		locations.clear();
+		status = Empty;
 	}
 
-	void setUniform(const vec2& v, const std::string& name) {
-		int location = getLocation(name);
-		if (location >= 0) glUniform2fv(location, 1, &v.x);
+	~GPUProgram() { release(); }
+};
+
+//---------------------------
+class UniformBuffer {	// buffer behind a std140 uniform block
+//---------------------------
+	unsigned int bufferId = 0;
+	size_t size = 0;
+public:
+	UniformBuffer() {}
+
+	UniformBuffer(const UniformBuffer& buffer) {
+		printf("\nError: Uniform buffer is not copied on GPU!!!\n");
 	}
 
-	void setUniform(const vec3& v, const std::string& name) {
-		int location = getLocation(name);
-		if (location >= 0) glUniform3fv(location, 1, &v.x);
+	void operator=(const UniformBuffer& buffer) {
+		printf("\nError: Uniform buffer is not copied on GPU!!!\n");
 	}
 
-	void setUniform(const vec4& v, const std::string& name) {
-		int location = getLocation(name);
-		if (location >= 0) glUniform4fv(location, 1, &v.x);
+	unsigned int getId() { return bufferId; }
+
+	void upload(const void* data, size_t dataSize) {	// the layout of data has to follow the std140 rules
+		if (bufferId == 0) glGenBuffers(1, &bufferId);
+		glBindBuffer(GL_UNIFORM_BUFFER, bufferId);
+		if (dataSize != size) glBufferData(GL_UNIFORM_BUFFER, dataSize, data, GL_DYNAMIC_DRAW);
+		else glBufferSubData(GL_UNIFORM_BUFFER, 0, dataSize, data);
+		size = dataSize;
 	}
 
-	void setUniform(const mat4& mat, const std::string& name) {
-		int location = getLocation(name);
-		if (location >= 0) glUniformMatrix4fv(location, 1, GL_TRUE, mat);
+	void bind(unsigned int binding) {	// make it the source of the blocks connected to this binding point
+		glState().bindUniformBuffer(binding, bufferId);
 	}
 
-	void setUniform(const Texture& texture, const std::string& samplerName, unsigned int textureUnit = 0) {
-		int location = getLocation(samplerName);
-		if (location >= 0) {
-			glUniform1i(location, textureUnit);
-			glActiveTexture(GL_TEXTURE0 + textureUnit);
-			glBindTexture(GL_TEXTURE_2D, texture.textureId);
+	void release() {	// while the context is current, the buffer is created again by the next upload
+		if (bufferId > 0) {
+			glDeleteBuffers(1, &bufferId);
+			glState().invalidate();
+		}
+		bufferId = 0;
+		size = 0;
+	}
+
+	~UniformBuffer() { release(); }
+};
+
+//---------------------------
+class TextureBuffer {	// buffer read by texelFetch from a samplerBuffer, for arrays larger than a uniform block
+//---------------------------
+	unsigned int bufferId = 0, textureId = 0;
+	GLenum format;	// of a texel, e.g. GL_RGBA32F or GL_R32UI
+public:
+	TextureBuffer(GLenum _format) : format(_format) {}
+
+	TextureBuffer(const TextureBuffer& buffer) {
+		printf("\nError: Texture buffer is not copied on GPU!!!\n");
+	}
+
+	void operator=(const TextureBuffer& buffer) {
+		printf("\nError: Texture buffer is not copied on GPU!!!\n");
+	}
+
+	void upload(const void* data, size_t dataSize) {	// whole new content, the old storage is orphaned
+		bool created = (bufferId == 0);
+		if (created) {
+			glGenBuffers(1, &bufferId);
+			glGenTextures(1, &textureId);
+		}
+		glBindBuffer(GL_TEXTURE_BUFFER, bufferId);
+		if (dataSize > 0) glBufferData(GL_TEXTURE_BUFFER, dataSize, data, GL_STREAM_DRAW);
+		else glBufferData(GL_TEXTURE_BUFFER, 16, nullptr, GL_STREAM_DRAW);	// a buffer texture needs storage
+		if (created) {	// the texture follows the new storage of its buffer
+			glBindTexture(GL_TEXTURE_BUFFER, textureId);
+			glTexBuffer(GL_TEXTURE_BUFFER, format, bufferId);
 		}
 	}
 
-	~GPUProgram() { if (shaderProgramId > 0) glDeleteProgram(shaderProgramId); }
+	void bind(unsigned int textureUnit) {
+		glActiveTexture(GL_TEXTURE0 + textureUnit);
+		glBindTexture(GL_TEXTURE_BUFFER, textureId);
+		glActiveTexture(GL_TEXTURE0);
+	}
+
+	void release() {	// while the context is current, the buffer is created again by the next upload
+		if (textureId > 0) glDeleteTextures(1, &textureId);
+		if (bufferId > 0) glDeleteBuffers(1, &bufferId);
+		bufferId = textureId = 0;
+	}
+
+	~TextureBuffer() { release(); }
+};
+
+//---------------------------
+class Arena {	// bump allocator: the objects made in it live until release, which frees them at once
+//---------------------------
+	struct Block {
+		char* memory;
+		size_t size, used;
+	};
+	struct Destructor {
+		void (*destroy)(void*);
+		void* object;
+	};
+	std::vector<Block> blocks;
+	std::vector<Destructor> destructors;	// of the objects that need one, in the order of construction
+	size_t blockSize;
+	size_t bytes = 0;						// allocated by the objects
+public:
+	Arena(size_t _blockSize = 64 * 1024) : blockSize(_blockSize) { }
+	Arena(const Arena&) = delete;
+	void operator=(const Arena&) = delete;
+
+	void* allocate(size_t size, size_t alignment) {	// alignment is a power of 2
+		for (int attempt = 0; attempt < 2; attempt++) {
+			if (!blocks.empty()) {
+				Block& block = blocks.back();
+				size_t address = (size_t)(block.memory + block.used);
+				size_t padding = (alignment - address % alignment) % alignment;
+				if (block.used + padding + size <= block.size) {
+					block.used += padding + size;
+					bytes += size;
+					return block.memory + block.used - size;
+				}
+			}
+			size_t newSize = (size + alignment > blockSize) ? size + alignment : blockSize;	// large objects get their own block
+			blocks.push_back(Block{ new char[newSize], newSize, 0 });
+		}
+		return nullptr;
+	}
+
+	template<class T, class... Args> T* make(Args&&... args) {
+		T* object = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+		if (!std::is_trivially_destructible<T>::value)
+			destructors.push_back(Destructor{ [](void* p) { static_cast<T*>(p)->~T(); }, object });
+		return object;
+	}
+
+	size_t size() const { return bytes; }
+
+	void release() {	// destroys the objects in reverse order and frees the memory
+		for (size_t i = destructors.size(); i-- > 0; ) destructors[i].destroy(destructors[i].object);
+		destructors.clear();
+		for (Block& block : blocks) delete[] block.memory;
+		blocks.clear();
+		bytes = 0;
+	}
+
+	~Arena() { release(); }
+};
+
+//---------------------------
+class MeshOptimizer {	// reorders indexed triangle lists for the post-transform vertex cache, overdraw and vertex fetch
+//---------------------------
+	static const int lruSize = 32;	// cache modelled by the vertex cache ordering
+	static const int fifoSize = 16;	// cache modelled by the statistics and the cluster boundaries
+
+	// Forsyth's score of a vertex from its position in the LRU cache and the number of its triangles still to emit
+	static float VertexScore(int cachePosition, unsigned int remaining) {
+		if (remaining == 0) return -1;
+		float score = 0;
+		if (cachePosition >= 0)
+			score = (cachePosition < 3) ? 0.75f : powf(1 - (float)(cachePosition - 3) / (lruSize - 3), 1.5f);
+		return score + 2 / sqrtf((float)remaining);
+	}
+
+	class Fifo {	// a vertex is in the cache if fewer than fifoSize misses happened since it was loaded
+		std::vector<size_t> loaded;
+		size_t misses = fifoSize + 1;
+	public:
+		Fifo(size_t nVertices) : loaded(nVertices, 0) { }
+		bool Miss(unsigned int v) {
+			if (misses - loaded[v] <= fifoSize) return false;
+			loaded[v] = misses++;
+			return true;
+		}
+		void Flush() { misses += fifoSize + 1; }
+	};
+public:
+	struct Stats {
+		float acmr;	// average cache miss ratio, transformed vertices per triangle, 0.5 is ideal for a regular grid
+		float atvr;	// average transformed to vertex ratio, 1 is ideal
+	};
+
+	static Stats Analyze(const std::vector<unsigned int>& indices, size_t nVertices) {
+		Fifo fifo(nVertices);
+		size_t misses = 0;
+		for (unsigned int v : indices) if (fifo.Miss(v)) misses++;
+		Stats stats = { 0, 0 };
+		if (!indices.empty()) stats.acmr = (float)misses / (indices.size() / 3);
+		if (nVertices > 0) stats.atvr = (float)misses / nVertices;
+		return stats;
+	}
+
+	// Forsyth, Linear-speed vertex cache optimisation: emits the best scored triangle of the cached vertices
+	static void OptimizeVertexCache(std::vector<unsigned int>& indices, size_t nVertices) {
+		size_t nTriangles = indices.size() / 3;
+		if (nTriangles == 0) return;
+		std::vector<unsigned int> remaining(nVertices, 0), first(nVertices + 1, 0);
+		for (unsigned int v : indices) remaining[v]++;
+		for (size_t v = 0; v < nVertices; v++) first[v + 1] = first[v] + remaining[v];
+		std::vector<unsigned int> triangles(indices.size());	// of the vertices, the first remaining[v] are not emitted yet
+		std::vector<unsigned int> fill(first.begin(), first.end() - 1);
+		for (size_t i = 0; i < indices.size(); i++) triangles[fill[indices[i]]++] = (unsigned int)(i / 3);
+
+		std::vector<int> cachePosition(nVertices, -1);
+		std::vector<float> vertexScore(nVertices), triangleScore(nTriangles, 0);
+		for (size_t v = 0; v < nVertices; v++) vertexScore[v] = VertexScore(-1, remaining[v]);
+		for (size_t i = 0; i < indices.size(); i++) triangleScore[i / 3] += vertexScore[indices[i]];
+		std::vector<bool> emitted(nTriangles, false);
+		std::vector<unsigned int> result, cache, newCache;
+		result.reserve(indices.size());
+
+		size_t best = std::max_element(triangleScore.begin(), triangleScore.end()) - triangleScore.begin();
+		size_t scan = 0;	// the triangles before it are emitted, the next one is taken when the cache has nothing to offer
+		while (result.size() < indices.size()) {
+			emitted[best] = true;
+			newCache.clear();
+			for (int k = 0; k < 3; k++) {
+				unsigned int v = indices[best * 3 + k];
+				result.push_back(v);
+				unsigned int* list = &triangles[first[v]];
+				unsigned int* last = list + --remaining[v];
+				*std::find(list, last + 1, (unsigned int)best) = *last;
+				if (std::find(newCache.begin(), newCache.end(), v) == newCache.end()) newCache.push_back(v);
+			}
+			for (unsigned int v : cache) if (std::find(newCache.begin(), newCache.end(), v) == newCache.end()) newCache.push_back(v);
+			for (size_t i = 0; i < newCache.size(); i++) {	// the vertices pushed out of the cache are rescored too
+				unsigned int v = newCache[i];
+				cachePosition[v] = (i < lruSize) ? (int)i : -1;
+				float score = VertexScore(cachePosition[v], remaining[v]);
+				for (unsigned int j = 0; j < remaining[v]; j++) triangleScore[triangles[first[v] + j]] += score - vertexScore[v];
+				vertexScore[v] = score;
+			}
+			cache.assign(newCache.begin(), newCache.begin() + std::min(newCache.size(), (size_t)lruSize));
+
+			float bestScore = -1;
+			for (unsigned int v : cache) {
+				for (unsigned int j = 0; j < remaining[v]; j++) {
+					unsigned int t = triangles[first[v] + j];
+					if (triangleScore[t] > bestScore) { bestScore = triangleScore[t]; best = t; }
+				}
+			}
+			if (bestScore < 0 && result.size() < indices.size()) {
+				while (emitted[scan]) scan++;
+				best = scan;
+			}
+		}
+		indices.swap(result);
+	}
+
+	// Sander et al., Fast triangle reordering for vertex locality and reduced overdraw: the cache ordered list is cut
+	// into clusters where the cache restarts or where a cut costs less than threshold times the misses of the cluster,
+	// then the clusters facing outwards from the center of the mesh are drawn first
+	static void OptimizeOverdraw(std::vector<unsigned int>& indices, const vec3* positions, size_t stride, size_t nVertices, float threshold = 1.05f) {
+		size_t nTriangles = indices.size() / 3;
+		if (nTriangles == 0) return;
+		auto position = [&](unsigned int v) { return *(const vec3*)((const char*)positions + v * stride); };
+		auto misses = [&](Fifo& fifo, size_t t) {
+			return (int)fifo.Miss(indices[t * 3]) + (int)fifo.Miss(indices[t * 3 + 1]) + (int)fifo.Miss(indices[t * 3 + 2]);
+		};
+
+		std::vector<size_t> hard;	// first triangles of the clusters
+		Fifo fifo(nVertices);
+		for (size_t t = 0; t < nTriangles; t++) if (misses(fifo, t) == 3) hard.push_back(t);
+		hard.push_back(nTriangles);
+
+		std::vector<size_t> clusters;
+		for (size_t c = 0; c + 1 < hard.size(); c++) {
+			fifo.Flush();
+			size_t clusterMisses = 0;
+			for (size_t t = hard[c]; t < hard[c + 1]; t++) clusterMisses += misses(fifo, t);
+			float target = threshold * clusterMisses / (hard[c + 1] - hard[c]);
+			fifo.Flush();
+			size_t start = hard[c], runMisses = 0;
+			clusters.push_back(start);
+			for (size_t t = hard[c]; t + 1 < hard[c + 1]; t++) {
+				runMisses += misses(fifo, t);
+				if ((float)runMisses / (t + 1 - start) <= target) {
+					fifo.Flush();
+					start = t + 1;
+					runMisses = 0;
+					clusters.push_back(start);
+				}
+			}
+		}
+		clusters.push_back(nTriangles);
+
+		size_t nClusters = clusters.size() - 1;
+		std::vector<vec3> centroids(nClusters, vec3(0, 0, 0)), normals(nClusters, vec3(0, 0, 0));
+		std::vector<float> areas(nClusters, 0);
+		vec3 meshCentroid(0, 0, 0);
+		float meshArea = 0;
+		for (size_t c = 0; c < nClusters; c++) {
+			for (size_t t = clusters[c]; t < clusters[c + 1]; t++) {
+				vec3 p0 = position(indices[t * 3]), p1 = position(indices[t * 3 + 1]), p2 = position(indices[t * 3 + 2]);
+				vec3 normal = cross(p1 - p0, p2 - p0);	// of the front face, area weighted
+				float area = length(normal);
+				centroids[c] = centroids[c] + (p0 + p1 + p2) * (area / 3);
+				normals[c] = normals[c] + normal;
+				areas[c] += area;
+			}
+			meshCentroid = meshCentroid + centroids[c];
+			meshArea += areas[c];
+			if (areas[c] > 0) centroids[c] = centroids[c] / areas[c];
+		}
+		if (meshArea > 0) meshCentroid = meshCentroid / meshArea;
+
+		std::vector<float> keys(nClusters, 0);
+		std::vector<size_t> order(nClusters);
+		for (size_t c = 0; c < nClusters; c++) {
+			order[c] = c;
+			if (length(normals[c]) > 0) keys[c] = dot(centroids[c] - meshCentroid, normalize(normals[c]));
+		}
+		std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return keys[a] > keys[b]; });
+
+		std::vector<unsigned int> result;
+		result.reserve(indices.size());
+		for (size_t c : order) result.insert(result.end(), indices.begin() + clusters[c] * 3, indices.begin() + clusters[c + 1] * 3);
+		indices.swap(result);
+	}
+
+	// numbers the vertices in the order of their first use, the unused ones go to the end, returns the new number of each
+	static std::vector<unsigned int> OptimizeVertexFetch(std::vector<unsigned int>& indices, size_t nVertices) {
+		const unsigned int unused = ~0u;
+		std::vector<unsigned int> remap(nVertices, unused);
+		unsigned int next = 0;
+		for (unsigned int& v : indices) {
+			if (remap[v] == unused) remap[v] = next++;
+			v = remap[v];
+		}
+		for (unsigned int& r : remap) if (r == unused) r = next++;
+		return remap;
+	}
+
+	template<class Vertex> static void RemapVertices(std::vector<Vertex>& vertices, const std::vector<unsigned int>& remap) {
+		std::vector<Vertex> result(vertices.size());
+		for (size_t v = 0; v < vertices.size(); v++) result[remap[v]] = vertices[v];
+		vertices.swap(result);
+	}
+};
+
+//---------------------------
+class ThreadPool {
+//---------------------------
+	std::vector<std::thread> workers;
+	std::deque<std::function<void()>> tasks;
+	std::mutex mutex;
+	std::condition_variable wakeUp;
+	bool stopping = false;
+
+	void work() {
+		for (;;) {
+			std::function<void()> task;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wakeUp.wait(lock, [this] { return stopping || !tasks.empty(); });
+				if (stopping && tasks.empty()) return;
+				task = std::move(tasks.front());
+				tasks.pop_front();
+			}
+			task();
+		}
+	}
+
+public:
+	ThreadPool(unsigned int nThreads = std::thread::hardware_concurrency()) {
+		if (nThreads == 0) nThreads = 1;
+		for (unsigned int i = 0; i < nThreads; i++) workers.emplace_back(&ThreadPool::work, this);
+	}
+
+	ThreadPool(const ThreadPool&) = delete;
+	void operator=(const ThreadPool&) = delete;
+
+	unsigned int size() const { return (unsigned int)workers.size(); }
+
+	template<class F> std::future<decltype(std::declval<F>()())> submit(F f) {	// run f on a worker thread
+		typedef decltype(f()) R;
+		auto task = std::make_shared<std::packaged_task<R()>>(std::move(f));
+		std::future<R> result = task->get_future();
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			tasks.emplace_back([task] { (*task)(); });
+		}
+		wakeUp.notify_one();
+		return result;
+	}
+
+	// body(i) for every i in [begin, end), chunks of grainSize items are shared between the workers and the caller
+	template<class F> void parallelFor(int begin, int end, F body, int grainSize = 1) {
+		if (grainSize < 1) grainSize = 1;
+		int nChunks = (end - begin + grainSize - 1) / grainSize;
+		if (nChunks <= 1 || size() <= 1) {
+			for (int i = begin; i < end; i++) body(i);
+			return;
+		}
+		struct Shared {
+			std::atomic<int> next{ 0 }, done{ 0 };
+			std::mutex mutex;
+			std::condition_variable finished;
+		};
+		auto shared = std::make_shared<Shared>();
+		auto run = [shared, begin, end, grainSize, nChunks, &body] {	// body is only touched while chunks remain
+			int chunk;
+			while ((chunk = shared->next++) < nChunks) {
+				int first = begin + chunk * grainSize, last = (first + grainSize < end) ? first + grainSize : end;
+				for (int i = first; i < last; i++) body(i);
+				if (++shared->done == nChunks) {
+					std::lock_guard<std::mutex> lock(shared->mutex);
+					shared->finished.notify_all();
+				}
+			}
+		};
+		unsigned int nHelpers = ((unsigned int)nChunks - 1 < size()) ? (unsigned int)nChunks - 1 : size();
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			for (unsigned int i = 0; i < nHelpers; i++) tasks.emplace_back(run);
+		}
+		wakeUp.notify_all();
+		run();	// the caller works too, so nested calls cannot starve
+		std::unique_lock<std::mutex> lock(shared->mutex);
+		shared->finished.wait(lock, [&shared, nChunks] { return shared->done == nChunks; });
+	}
+
+	~ThreadPool() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wakeUp.notify_all();
+		for (std::thread& worker : workers) worker.join();
+	}
+};
+
+inline ThreadPool& threadPool() { // shared pool of the application, started on first use
+	static ThreadPool pool;
+	return pool;
+}
+
+//---------------------------
+class TextureStreamer {
+//---------------------------
+	// Textures are decoded on the thread pool and uploaded by update on the GL thread, through a pixel buffer
+	// object and at most uploadBudget bytes per frame. Until then a handle shows a 1x1 gray placeholder.
+	struct Decoded {
+		Texture* texture;	// kept alive by the cache
+		int width, height;
+		std::vector<unsigned char> image;
+	};
+
+	std::unordered_map<std::string, std::shared_ptr<Texture>> textures;	// by path and transparency
+	std::deque<Decoded> ready;	// decoded, waiting for upload, guarded by mutex
+	int pending = 0;			// decodes still running, guarded by mutex
+	std::mutex mutex;
+	std::condition_variable decoded;
+	unsigned int pbo = 0;
+
+	void upload(Decoded& item) {
+		size_t size = item.image.size();
+		if (pbo == 0) glGenBuffers(1, &pbo);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, size, nullptr, GL_STREAM_DRAW);	// orphan the storage of the previous upload
+		void* dst = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+		if (dst) {
+			memcpy(dst, &item.image[0], size);
+			glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+			item.texture->create(item.width, item.height, (const unsigned char*)nullptr);	// from offset 0 of the buffer
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		}
+		else {	// mapping failed, upload from client memory
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+			item.texture->create(item.width, item.height, item.image);
+		}
+	}
+
+public:
+	size_t uploadBudget = 4 << 20;	// bytes uploaded per frame, at least one texture goes every frame
+
+	TextureStreamer() { }
+	TextureStreamer(const TextureStreamer&) = delete;
+	void operator=(const TextureStreamer&) = delete;
+
+	// The texture of a bmp file, the same handle for the same file. Call it on the GL thread.
+	std::shared_ptr<Texture> load(const std::string& pathname, bool transparent = false) {
+		std::string key = transparent ? pathname + "#transparent" : pathname;
+		auto found = textures.find(key);
+		if (found != textures.end()) return found->second;
+
+		std::shared_ptr<Texture> texture = std::make_shared<Texture>();
+		static const unsigned char gray[4] = { 128, 128, 128, 255 };
+		texture->create(1, 1, gray);
+		textures[key] = texture;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			pending++;
+		}
+		Texture* target = texture.get();
+		threadPool().submit([this, target, pathname, transparent] {
+			Decoded item;
+			item.texture = target;
+			bool ok = Texture::load(pathname, transparent, item.width, item.height, item.image);
+			std::lock_guard<std::mutex> lock(mutex);
+			if (ok) ready.push_back(std::move(item));	// a failed file keeps the placeholder
+			pending--;
+			decoded.notify_all();
+		});
+		return texture;
+	}
+
+	void update() {	// GL thread, once per frame, called by the framework before onDisplay
+		size_t uploaded = 0;
+		while (uploaded < uploadBudget) {
+			Decoded item;
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if (ready.empty()) return;
+				item = std::move(ready.front());
+				ready.pop_front();
+			}
+			upload(item);
+			uploaded += item.image.size();
+		}
+	}
+
+	void finish() {	// waits for the running decodes and uploads everything, for example before a benchmark
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			decoded.wait(lock, [this] { return pending == 0; });
+		}
+		size_t budget = uploadBudget;
+		uploadBudget = (size_t)-1;
+		update();
+		uploadBudget = budget;
+	}
+
+	int remaining() {	// textures not uploaded yet
+		std::lock_guard<std::mutex> lock(mutex);
+		return pending + (int)ready.size();
+	}
+
+	~TextureStreamer() {
+		std::unique_lock<std::mutex> lock(mutex);	// the workers refer to this object
+		decoded.wait(lock, [this] { return pending == 0; });
+		if (pbo > 0) glDeleteBuffers(1, &pbo);
+	}
+};
+
+inline TextureStreamer& textureStreamer() { // textures of the application, see TextureStreamer::load
+	static TextureStreamer streamer;
+	return streamer;
+}
+
+//---------------------------
+class TextOverlay {	// lines of text over the frame, 5x7 pixel font of upper case letters, digits and a few signs
+//---------------------------
+	static const int glyphWidth = 5, glyphHeight = 7;
+	GPUProgram program{ false };
+	unsigned int vao = 0, vbo = 0, fontTexture = 0;
+	int nGlyphs = 0;
+	std::vector<float> vertices;	// x, y in pixels from the top left corner, u, v
+
+	static const char* glyphChars() { return " ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789.:-/_()%="; }
+
+	void create() {
+		static const unsigned char glyphs[][glyphHeight] = {	// rows from the top, the highest of 5 bits is the left column
+			{ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }, { 0x0E, 0x11, 0x11, 0x1F, 0x11, 0x11, 0x11 }, { 0x1E, 0x11, 0x11, 0x1E, 0x11, 0x11, 0x1E }, { 0x0E, 0x11, 0x10, 0x10, 0x10, 0x11, 0x0E },
+			{ 0x1E, 0x11, 0x11, 0x11, 0x11, 0x11, 0x1E }, { 0x1F, 0x10, 0x10, 0x1E, 0x10, 0x10, 0x1F }, { 0x1F, 0x10, 0x10, 0x1E, 0x10, 0x10, 0x10 }, { 0x0E, 0x11, 0x10, 0x17, 0x11, 0x11, 0x0F },
+			{ 0x11, 0x11, 0x11, 0x1F, 0x11, 0x11, 0x11 }, { 0x0E, 0x04, 0x04, 0x04, 0x04, 0x04, 0x0E }, { 0x07, 0x02, 0x02, 0x02, 0x02, 0x12, 0x0C }, { 0x11, 0x12, 0x14, 0x18, 0x14, 0x12, 0x11 },
+			{ 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x1F }, { 0x11, 0x1B, 0x15, 0x15, 0x11, 0x11, 0x11 }, { 0x11, 0x11, 0x19, 0x15, 0x13, 0x11, 0x11 }, { 0x0E, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0E },
+			{ 0x1E, 0x11, 0x11, 0x1E, 0x10, 0x10, 0x10 }, { 0x0E, 0x11, 0x11, 0x11, 0x15, 0x12, 0x0D }, { 0x1E, 0x11, 0x11, 0x1E, 0x14, 0x12, 0x11 }, { 0x0F, 0x10, 0x10, 0x0E, 0x01, 0x01, 0x1E },
+			{ 0x1F, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04 }, { 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0E }, { 0x11, 0x11, 0x11, 0x11, 0x11, 0x0A, 0x04 }, { 0x11, 0x11, 0x11, 0x15, 0x15, 0x15, 0x0A },
+			{ 0x11, 0x11, 0x0A, 0x04, 0x0A, 0x11, 0x11 }, { 0x11, 0x11, 0x0A, 0x04, 0x04, 0x04, 0x04 }, { 0x1F, 0x01, 0x02, 0x04, 0x08, 0x10, 0x1F }, { 0x0E, 0x11, 0x13, 0x15, 0x19, 0x11, 0x0E },
+			{ 0x04, 0x0C, 0x04, 0x04, 0x04, 0x04, 0x0E }, { 0x0E, 0x11, 0x01, 0x02, 0x04, 0x08, 0x1F }, { 0x1F, 0x02, 0x04, 0x02, 0x01, 0x11, 0x0E }, { 0x02, 0x06, 0x0A, 0x12, 0x1F, 0x02, 0x02 },
+			{ 0x1F, 0x10, 0x1E, 0x01, 0x01, 0x11, 0x0E }, { 0x06, 0x08, 0x10, 0x1E, 0x11, 0x11, 0x0E }, { 0x1F, 0x01, 0x02, 0x04, 0x08, 0x08, 0x08 }, { 0x0E, 0x11, 0x11, 0x0E, 0x11, 0x11, 0x0E },
+			{ 0x0E, 0x11, 0x11, 0x0F, 0x01, 0x02, 0x0C }, { 0x00, 0x00, 0x00, 0x00, 0x00, 0x0C, 0x0C }, { 0x00, 0x0C, 0x0C, 0x00, 0x0C, 0x0C, 0x00 }, { 0x00, 0x00, 0x00, 0x1F, 0x00, 0x00, 0x00 },
+			{ 0x00, 0x01, 0x02, 0x04, 0x08, 0x10, 0x00 }, { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x1F }, { 0x02, 0x04, 0x08, 0x08, 0x08, 0x04, 0x02 }, { 0x08, 0x04, 0x02, 0x02, 0x02, 0x04, 0x08 },
+			{ 0x18, 0x19, 0x02, 0x04, 0x08, 0x13, 0x03 }, { 0x00, 0x00, 0x1F, 0x00, 0x1F, 0x00, 0x00 },
+		};
+		nGlyphs = (int)strlen(glyphChars());
+		std::vector<unsigned char> texels(nGlyphs * glyphWidth * glyphHeight);	// glyphs side by side, bottom row first
+		for (int g = 0; g < nGlyphs; g++)
+			for (int row = 0; row < glyphHeight; row++)
+				for (int column = 0; column < glyphWidth; column++)
+					texels[(glyphHeight - 1 - row) * nGlyphs * glyphWidth + g * glyphWidth + column] = (glyphs[g][row] >> (glyphWidth - 1 - column) & 1) ? 255 : 0;
+		glGenTextures(1, &fontTexture);
+		glBindTexture(GL_TEXTURE_2D, fontTexture);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, nGlyphs * glyphWidth, glyphHeight, 0, GL_RED, GL_UNSIGNED_BYTE, &texels[0]);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+		const char* vertexSource = R"(
+			#version 330
+			precision highp float;
+			uniform vec2 viewport;
+			layout(location = 0) in vec2 vtxPos;	// pixels from the top left corner
+			layout(location = 1) in vec2 vtxUV;
+			out vec2 texcoord;
+			void main() {
+				texcoord = vtxUV;
+				gl_Position = vec4(vtxPos.x / viewport.x * 2 - 1, 1 - vtxPos.y / viewport.y * 2, 0, 1);
+			}
+		)";
+		const char* fragmentSource = R"(
+			#version 330
+			precision highp float;
+			uniform sampler2D font;
+			in vec2 texcoord;
+			out vec4 fragmentColor;
+			void main() {
+				if (texcoord.x < 0) fragmentColor = vec4(0, 0, 0, 0.6);	// background
+				else if (texture(font, texcoord).r > 0.5) fragmentColor = vec4(1, 1, 0.6, 1);
+				else discard;
+			}
+		)";
+		program.create(vertexSource, fragmentSource, "fragmentColor");
+		glGenVertexArrays(1, &vao);
+		glState().bindVertexArray(vao);
+		glGenBuffers(1, &vbo);
+		glBindBuffer(GL_ARRAY_BUFFER, vbo);
+		glEnableVertexAttribArray(0);
+		glEnableVertexAttribArray(1);
+		glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void*)0);
+		glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void*)(2 * sizeof(float)));
+	}
+
+	void quad(float x0, float y0, float x1, float y1, float u0, float v0, float u1, float v1) {	// two triangles
+		float corners[6][4] = { { x0, y0, u0, v1 }, { x1, y0, u1, v1 }, { x1, y1, u1, v0 },
+								{ x0, y0, u0, v1 }, { x1, y1, u1, v0 }, { x0, y1, u0, v0 } };
+		for (auto& corner : corners) vertices.insert(vertices.end(), corner, corner + 4);
+	}
+
+public:
+	int scale = 2;	// screen pixels per font pixel
+
+	void draw(const std::vector<std::string>& lines, float left = 8, float top = 8) {
+		if (lines.empty()) return;
+		if (vao == 0) create();
+		float advance = (glyphWidth + 1) * (float)scale, lineHeight = (glyphHeight + 3) * (float)scale;
+		size_t longest = 0;
+		for (const std::string& line : lines) longest = (line.size() > longest) ? line.size() : longest;
+		vertices.clear();
+		quad(left - scale * 2, top - scale * 2, left + longest * advance + scale, top + lines.size() * lineHeight, -1, -1, -1, -1);
+		for (size_t l = 0; l < lines.size(); l++) {
+			for (size_t c = 0; c < lines[l].size(); c++) {
+				const char* found = strchr(glyphChars(), toupper((unsigned char)lines[l][c]));
+				int g = (found && *found) ? (int)(found - glyphChars()) : 0;
+				if (g == 0) continue;	// space or unknown
+				float x = left + c * advance, y = top + l * lineHeight;
+				quad(x, y, x + glyphWidth * scale, y + glyphHeight * scale,
+					(float)g / nGlyphs, 0, (float)(g + 1) / nGlyphs, 1);
+			}
+		}
+
+		GLboolean depthTest = glIsEnabled(GL_DEPTH_TEST), blend = glIsEnabled(GL_BLEND), cullFace = glIsEnabled(GL_CULL_FACE);
+		glDisable(GL_DEPTH_TEST);
+		glDisable(GL_CULL_FACE);
+		glEnable(GL_BLEND);
+		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+		program.Use();
+		program.setUniform(vec2((float)windowWidth, (float)windowHeight), "viewport");
+		program.setUniform(0, "font");
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D, fontTexture);
+		glState().bindVertexArray(vao);
+		glBindBuffer(GL_ARRAY_BUFFER, vbo);
+		glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(float), &vertices[0], GL_STREAM_DRAW);
+		glDrawArrays(GL_TRIANGLES, 0, (int)vertices.size() / 4);
+		if (depthTest) glEnable(GL_DEPTH_TEST);
+		if (cullFace) glEnable(GL_CULL_FACE);
+		if (!blend) glDisable(GL_BLEND);
+	}
+
+	void release() {	// while the context is current, the next draw creates the objects again
+		if (vao == 0) return;
+		glDeleteTextures(1, &fontTexture);
+		glDeleteBuffers(1, &vbo);
+		glDeleteVertexArrays(1, &vao);
+		glState().invalidate();
+		vao = vbo = fontTexture = 0;
+		program.release();
+	}
+
+	~TextOverlay() { release(); }
+};
+
+//---------------------------
+class Profiler {
+//---------------------------
+	// CPU time of scopes on any thread, and GPU time of the scopes on the GL thread from GL_TIMESTAMP queries, which
+	// unlike GL_TIME_ELAPSED can nest. A frame runs from one swapBuffers to the next. The queries of a frame are read
+	// when its slot comes around again, nSlots - 1 frames later, so the GPU has finished them and reading does not stall.
+public:
+	struct Event {
+		const char* name;
+		int frame;
+		int thread;				// 0 is the GL thread
+		int depth;				// nesting on its thread, the frame itself is 0
+		double cpuStart, cpuMs;	// from the start of the profiler
+		double gpuStart, gpuMs;	// on the same clock, gpuMs < 0 without GPU timing
+	};
+
+	struct Handle {	// of an open scope
+		int frame = -1, index = -1;
+	};
+
+private:
+	struct Record {
+		Event event;
+		int query;		// begin timestamp in the queries of the slot, the end is the next one, -1 for none
+		bool closed;
+	};
+
+	struct Slot {
+		int frame = -1;
+		std::vector<Record> records;
+		std::vector<unsigned int> queries;
+		int nQueries = 0;	// used in this frame
+	};
+
+	struct Row {	// line of the overlay, a scope summed over a frame and smoothed over frames
+		const char* name;
+		int thread, depth, count;
+		double cpuMs, gpuMs;
+	};
+
+	static const int nSlots = 3;
+	Slot slots[nSlots];
+	int frame = 0;
+	Handle frameScope;
+	std::atomic<bool> running{ false };
+	std::mutex mutex;
+	std::vector<std::thread::id> threads;	// index is the thread number of the events
+	std::vector<int> depths;				// of the open scopes per thread
+	std::chrono::steady_clock::time_point start;
+	double gpuOffset = 0;					// converts GPU timestamps to the CPU clock
+	std::vector<Row> rows;
+	std::vector<Event> captured;
+	TextOverlay text;
+
+	double now() const { return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count(); }
+
+	int threadIndex() {	// mutex is locked
+		std::thread::id id = std::this_thread::get_id();
+		for (size_t i = 0; i < threads.size(); i++) if (threads[i] == id) return (int)i;
+		threads.push_back(id);
+		depths.push_back(1);	// below the frame
+		return (int)threads.size() - 1;
+	}
+
+	void resolve(Slot& slot) {	// GL thread, mutex is locked
+		std::vector<Row> frameRows;
+		for (Record& record : slot.records) {
+			if (!record.closed) continue;
+			Event& event = record.event;
+			if (record.query >= 0) {
+				GLuint64 begin = 0, end = 0;
+				glGetQueryObjectui64v(slot.queries[record.query], GL_QUERY_RESULT, &begin);
+				glGetQueryObjectui64v(slot.queries[record.query + 1], GL_QUERY_RESULT, &end);
+				event.gpuStart = begin / 1e6 + gpuOffset;
+				event.gpuMs = (end - begin) / 1e6;
+			}
+			if (capture) captured.push_back(event);
+			Row* row = nullptr;
+			for (Row& r : frameRows) if (strcmp(r.name, event.name) == 0 && r.thread == event.thread && r.depth == event.depth) row = &r;
+			if (!row) {
+				frameRows.push_back(Row{ event.name, event.thread, event.depth, 0, 0, 0 });
+				row = &frameRows.back();
+			}
+			row->count++;
+			row->cpuMs += event.cpuMs;
+			row->gpuMs += (event.gpuMs > 0) ? event.gpuMs : 0;
+		}
+		for (Row& row : frameRows) {	// exponential smoothing with the rows of the previous frames
+			for (const Row& old : rows) {
+				if (strcmp(old.name, row.name) != 0 || old.thread != row.thread || old.depth != row.depth) continue;
+				row.cpuMs = old.cpuMs * 0.9 + row.cpuMs * 0.1;
+				row.gpuMs = old.gpuMs * 0.9 + row.gpuMs * 0.1;
+			}
+		}
+		std::stable_sort(frameRows.begin(), frameRows.end(), [](const Row& a, const Row& b) { return a.thread < b.thread; });
+		rows = frameRows;
+		slot.frame = -1;
+	}
+
+public:
+	bool capture = false;	// keep every event for write
+	bool overlay = true;	// show the smoothed times of the scopes over the frame
+
+	bool isRunning() const { return running; }
+
+	void startProfiling() {	// GL thread, with a current context
+		start = std::chrono::steady_clock::now();
+		GLint64 gpuNow = 0;
+		glGetInteger64v(GL_TIMESTAMP, &gpuNow);
+		gpuOffset = now() - gpuNow / 1e6;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			threads.assign(1, std::this_thread::get_id());
+			depths.assign(1, 1);
+			slots[0].frame = frame = 0;
+		}
+		running = true;
+		frameScope = begin("Frame");
+	}
+
+	Handle begin(const char* name, bool gpu = true) {
+		Handle handle;
+		if (!running) return handle;
+		double time = now();
+		std::lock_guard<std::mutex> lock(mutex);
+		int thread = threadIndex();
+		Slot& slot = slots[frame % nSlots];
+		Record record = { Event{ name, frame, thread, (frameScope.frame < 0 && thread == 0) ? 0 : depths[thread]++, time, 0, 0, -1 }, -1, false };
+		if (gpu && thread == 0) {
+			record.query = slot.nQueries;
+			slot.nQueries += 2;
+			while ((int)slot.queries.size() < slot.nQueries) {
+				unsigned int query;
+				glGenQueries(1, &query);
+				slot.queries.push_back(query);
+			}
+			glQueryCounter(slot.queries[record.query], GL_TIMESTAMP);
+		}
+		handle.frame = frame;
+		handle.index = (int)slot.records.size();
+		slot.records.push_back(record);
+		return handle;
+	}
+
+	void end(Handle handle) {
+		if (handle.frame < 0) return;
+		double time = now();
+		std::lock_guard<std::mutex> lock(mutex);
+		Slot& slot = slots[handle.frame % nSlots];
+		if (slot.frame != handle.frame) return;	// already resolved, the scope was longer than the frames in flight
+		Record& record = slot.records[handle.index];
+		record.event.cpuMs = time - record.event.cpuStart;
+		record.closed = true;
+		if (record.event.depth > 0) depths[record.event.thread]--;
+		if (record.query >= 0) glQueryCounter(slot.queries[record.query + 1], GL_TIMESTAMP);
+	}
+
+	void nextFrame() {	// GL thread, after the swap
+		if (!running) return;
+		end(frameScope);
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			frame++;
+			Slot& slot = slots[frame % nSlots];
+			if (slot.frame >= 0) resolve(slot);
+			slot.frame = frame;
+			slot.records.clear();
+			slot.nQueries = 0;
+		}
+		frameScope = Handle();
+		frameScope = begin("Frame");
+	}
+
+	std::vector<std::string> summary() {	// lines of the overlay
+		std::lock_guard<std::mutex> lock(mutex);
+		std::vector<std::string> lines;
+		char line[128];
+		double frameCpu = 0, gpuBusy = 0;
+		for (const Row& row : rows) {
+			if (row.thread == 0 && row.depth == 0) frameCpu = row.cpuMs;
+			if (row.thread == 0 && row.depth == 1) gpuBusy += row.gpuMs;
+		}
+		snprintf(line, sizeof(line), "FRAME %d  %.2f MS  %s", frame, frameCpu, (gpuBusy > 0.9 * frameCpu) ? "GPU BOUND" : "CPU BOUND");
+		lines.push_back(line);
+		lines.push_back("                    CPU MS   GPU MS");
+		for (const Row& row : rows) {
+			if (row.depth == 0) continue;
+			std::string name = std::string(2 * (row.depth - 1), ' ') + row.name;
+			if (row.thread > 0) name += " (" + std::to_string(row.thread) + ")";
+			if (row.count > 1) name += " X" + std::to_string(row.count);
+			if (row.thread == 0) snprintf(line, sizeof(line), "%-18.18s %7.2f  %7.2f", name.c_str(), row.cpuMs, row.gpuMs);
+			else snprintf(line, sizeof(line), "%-18.18s %7.2f", name.c_str(), row.cpuMs);
+			lines.push_back(line);
+		}
+		return lines;
+	}
+
+	void drawOverlay() {	// GL thread, before the swap
+		if (running && overlay) text.draw(summary());
+	}
+
+	void release() {	// GL thread, at exit after finish, stops the profiling and deletes the queries and the overlay
+		running = false;
+		std::lock_guard<std::mutex> lock(mutex);
+		for (Slot& slot : slots) {
+			if (!slot.queries.empty()) glDeleteQueries((int)slot.queries.size(), slot.queries.data());
+			slot.queries.clear();
+			slot.records.clear();
+			slot.nQueries = 0;
+		}
+		text.release();
+	}
+
+	void finish() {	// GL thread, reads the frames still in flight
+		if (!running) return;
+		std::lock_guard<std::mutex> lock(mutex);
+		for (int f = frame - nSlots + 1; f < frame; f++) {
+			Slot& slot = slots[((f % nSlots) + nSlots) % nSlots];
+			if (f >= 0 && slot.frame == f) resolve(slot);
+		}
+	}
+
+	// the captured events as Chrome trace JSON (chrome://tracing, Perfetto) if the name ends with .json, CSV otherwise
+	bool write(const std::string& pathname) {
+		FILE* file = fopen(pathname.c_str(), "w");
+		if (!file) {
+			printf("%s cannot be written\n", pathname.c_str());
+			return false;
+		}
+		std::lock_guard<std::mutex> lock(mutex);
+		bool json = pathname.size() >= 5 && pathname.compare(pathname.size() - 5, 5, ".json") == 0;
+		if (json) {
+			fprintf(file, "{ \"traceEvents\": [\n");
+			bool first = true;
+			for (const Event& e : captured) {	// CPU threads in process 0, the GPU in process 1
+				fprintf(file, "%s  { \"name\": \"%s\", \"ph\": \"X\", \"pid\": 0, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f, \"args\": { \"frame\": %d } }",
+					first ? "" : ",\n", e.name, e.thread, e.cpuStart * 1000, e.cpuMs * 1000, e.frame);
+				first = false;
+				if (e.gpuMs >= 0 && e.thread == 0)
+					fprintf(file, ",\n  { \"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": 0, \"ts\": %.3f, \"dur\": %.3f, \"args\": { \"frame\": %d } }",
+						e.name, e.gpuStart * 1000, e.gpuMs * 1000, e.frame);
+			}
+			fprintf(file, "\n],\n  \"displayTimeUnit\": \"ms\" }\n");
+		}
+		else {
+			fprintf(file, "frame,thread,depth,name,cpu_start_ms,cpu_ms,gpu_ms\n");
+			for (const Event& e : captured)
+				fprintf(file, "%d,%d,%d,%s,%.4f,%.4f,%.4f\n", e.frame, e.thread, e.depth, e.name, e.cpuStart, e.cpuMs, e.gpuMs);
+		}
+		fclose(file);
+		return true;
+	}
+};
+
+inline Profiler& profiler() { // profiler of the application, started by the framework with --profile
+	static Profiler instance;
+	return instance;
+}
+
+class ProfileScope {	// CPU and GPU time of a block if the profiler runs, nearly free otherwise
+	Profiler::Handle handle;
+public:
+	ProfileScope(const char* name, bool gpu = true) { handle = profiler().begin(name, gpu); }
+	~ProfileScope() { profiler().end(handle); }
 };
@@ -5,6 +5,13 @@
 //=============================================================================================
 
 #include "framework.h"
+#include <map>
+#include <tuple>
+#include <typeinfo>
+#include <typeindex>
+#include <string.h>
+#include <chrono>
+#include <algorithm>
 
 template<class T> struct Dnum {
 	float f;
@@ -34,7 +41,130 @@ template<class T> Dnum<T> Pow(Dnum<T> g, float n) {
 
 typedef Dnum<vec2> Dnum2;
 
+const int nLanes = 8;
+
+// nLanes Dnum2 values in structure-of-arrays layout, the lane loops below compile to SIMD code
+struct alignas(32) Dnum2x8 {
+	float f[nLanes], dx[nLanes], dy[nLanes];
+
+	Dnum2x8(float f0 = 0) {
+		for (int k = 0; k < nLanes; k++) { f[k] = f0; dx[k] = dy[k] = 0; }
+	}
+	Dnum2x8 operator+(const Dnum2x8& r) const {
+		Dnum2x8 g;
+		for (int k = 0; k < nLanes; k++) { g.f[k] = f[k] + r.f[k]; g.dx[k] = dx[k] + r.dx[k]; g.dy[k] = dy[k] + r.dy[k]; }
+		return g;
+	}
+	Dnum2x8 operator-(const Dnum2x8& r) const {
+		Dnum2x8 g;
+		for (int k = 0; k < nLanes; k++) { g.f[k] = f[k] - r.f[k]; g.dx[k] = dx[k] - r.dx[k]; g.dy[k] = dy[k] - r.dy[k]; }
+		return g;
+	}
+	Dnum2x8 operator*(const Dnum2x8& r) const {
+		Dnum2x8 g;
+		for (int k = 0; k < nLanes; k++) {
+			g.f[k] = f[k] * r.f[k];
+			g.dx[k] = f[k] * r.dx[k] + dx[k] * r.f[k];
+			g.dy[k] = f[k] * r.dy[k] + dy[k] * r.f[k];
+		}
+		return g;
+	}
+	Dnum2x8 operator*(float a) const {
+		Dnum2x8 g;
+		for (int k = 0; k < nLanes; k++) { g.f[k] = f[k] * a; g.dx[k] = dx[k] * a; g.dy[k] = dy[k] * a; }
+		return g;
+	}
+	Dnum2x8 operator/(const Dnum2x8& r) const {
+		Dnum2x8 g;
+		for (int k = 0; k < nLanes; k++) {
+			float rinv = 1 / r.f[k];
+			g.f[k] = f[k] * rinv;
+			g.dx[k] = (r.f[k] * dx[k] - r.dx[k] * f[k]) * rinv * rinv;
+			g.dy[k] = (r.f[k] * dy[k] - r.dy[k] * f[k]) * rinv * rinv;
+		}
+		return g;
+	}
+};
+
+// sine and cosine of all lanes from a single range reduction (Cephes polynomials, |x| < 8192)
+inline void SinCos8(const float x[nLanes], float s[nLanes], float c[nLanes]) {
+	for (int k = 0; k < nLanes; k++) {
+		float q = (x[k] * (float)M_2_PI + 12582912.0f) - 12582912.0f;	// nearest quadrant, rounded by the 1.5 * 2^23 trick
+		float r = ((x[k] - q * 1.5703125f) - q * 4.837512969970703125e-4f) - q * 7.54978995489188216e-8f;
+		float z = r * r;
+		float sr = ((-1.9515295891e-4f * z + 8.3321608736e-3f) * z - 1.6666654611e-1f) * z * r + r;
+		float cr = ((2.443315711809948e-5f * z - 1.388731625493765e-3f) * z + 4.166664568298827e-2f) * z * z - 0.5f * z + 1;
+		int quadrant = (int)q & 3;
+		float sw = (quadrant & 1) ? cr : sr, cw = (quadrant & 1) ? sr : cr;
+		s[k] = (quadrant & 2) ? -sw : sw;
+		c[k] = ((quadrant + 1) & 2) ? -cw : cw;
+	}
+}
+
+// e^x of all lanes (Cephes polynomial, 2^n is assembled in the exponent bits)
+inline void Exp8(const float x[nLanes], float e[nLanes]) {
+	for (int k = 0; k < nLanes; k++) {
+		float xc = (x[k] < -87.3f) ? -87.3f : ((x[k] > 88.3f) ? 88.3f : x[k]);
+		float n = (xc * (float)M_LOG2E + 12582912.0f) - 12582912.0f;
+		float r = (xc - n * 0.693359375f) + n * 2.12194440e-4f;
+		float p = (((((1.9875691500e-4f * r + 1.3981999507e-3f) * r + 8.3334519073e-3f) * r + 4.1665795894e-2f) * r
+			+ 1.6666665459e-1f) * r + 5.0000001201e-1f) * r * r + r + 1;
+		int bits = ((int)n + 127) << 23;
+		float scale;
+		memcpy(&scale, &bits, sizeof(float));
+		e[k] = p * scale;
+	}
+}
+
+inline Dnum2x8 Sin(const Dnum2x8& g) {
+	Dnum2x8 r;
+	float c[nLanes];
+	SinCos8(g.f, r.f, c);
+	for (int k = 0; k < nLanes; k++) { r.dx[k] = c[k] * g.dx[k]; r.dy[k] = c[k] * g.dy[k]; }
+	return r;
+}
+
+inline Dnum2x8 Cos(const Dnum2x8& g) {
+	Dnum2x8 r;
+	float s[nLanes];
+	SinCos8(g.f, s, r.f);
+	for (int k = 0; k < nLanes; k++) { r.dx[k] = -s[k] * g.dx[k]; r.dy[k] = -s[k] * g.dy[k]; }
+	return r;
+}
+
+inline Dnum2x8 Exp(const Dnum2x8& g) {
+	Dnum2x8 r;
+	Exp8(g.f, r.f);
+	for (int k = 0; k < nLanes; k++) { r.dx[k] = r.f[k] * g.dx[k]; r.dy[k] = r.f[k] * g.dy[k]; }
+	return r;
+}
+
+inline Dnum2x8 Tan(const Dnum2x8& g) { return Sin(g) / Cos(g); }
+
+inline Dnum2x8 Log(const Dnum2x8& g) {
+	Dnum2x8 r;
+	for (int k = 0; k < nLanes; k++) { r.f[k] = logf(g.f[k]); r.dx[k] = g.dx[k] / g.f[k]; r.dy[k] = g.dy[k] / g.f[k]; }
+	return r;
+}
+
+inline Dnum2x8 Pow(const Dnum2x8& g, float n) {
+	Dnum2x8 r;
+	for (int k = 0; k < nLanes; k++) {
+		float p = powf(g.f[k], n - 1);
+		r.f[k] = p * g.f[k]; r.dx[k] = n * p * g.dx[k]; r.dy[k] = n * p * g.dy[k];
+	}
+	return r;
+}
+
 const int tessellationLevel = 20;
+const int nLods = 4;				// detail levels of a surface: 2x, 1x, 0.5x and 0.25x tessellationLevel
+const float lodEdgePixels = 10;	// targeted screen space length of a silhouette edge
+const float lodHysteresis = 0.25f;	// a coarser level is taken only below this fraction of its resolution
+
+enum VertexFormat {	// vertex buffer layout, chosen per surface
+	FloatVertices,	// 32 bytes: float position, normal and texture coordinates
+	PackedVertices	// 16 bytes: position quantized in the bounds, octahedral normal, 16 bit texture coordinates
+};
 
 struct Camera {
 	vec3 wEye, wLookat, wVup;
@@ -50,10 +180,10 @@ public:
 		vec3 w = normalize(wEye - wLookat);
 		vec3 u = normalize(cross(wVup, w));
 		vec3 v = cross(w, u);
-		return TranslateMatrix(wEye * (-1)) * mat4(u.x, v.x, w.x, 0,
+		return mat4(u.x, v.x, w.x, 0,	// TranslateMatrix(-wEye) * rotation, without the multiplication
 			u.y, v.y, w.y, 0,
 			u.z, v.z, w.z, 0,
-			0, 0, 0, 1);
+			-dot(wEye, u), -dot(wEye, v), -dot(wEye, w), 1);
 	}
 
 	mat4 P() {
@@ -71,41 +201,507 @@ public:
 	}
 };
 
+struct AABB {	// axis aligned box
+	vec3 lo, hi;
+
+	AABB() : lo(1, 1, 1), hi(-1, -1, -1) { }	// empty
+	AABB(const vec3& _lo, const vec3& _hi) : lo(_lo), hi(_hi) { }
+
+	bool Empty() const { return lo.x > hi.x; }
+
+	void Grow(const AABB& b) {
+		if (b.Empty()) return;
+		if (Empty()) { *this = b; return; }
+		lo = vec3(fminf(lo.x, b.lo.x), fminf(lo.y, b.lo.y), fminf(lo.z, b.lo.z));
+		hi = vec3(fmaxf(hi.x, b.hi.x), fmaxf(hi.y, b.hi.y), fmaxf(hi.z, b.hi.z));
+	}
+
+	AABB Transformed(const mat4& M) const {	// box of the transformed box, from its center and the absolute matrix
+		vec3 c = (lo + hi) * 0.5f, e = (hi - lo) * 0.5f;
+		vec4 wc = vec4(c.x, c.y, c.z, 1) * M;
+		vec3 we(fabsf(M[0][0]) * e.x + fabsf(M[1][0]) * e.y + fabsf(M[2][0]) * e.z,
+			fabsf(M[0][1]) * e.x + fabsf(M[1][1]) * e.y + fabsf(M[2][1]) * e.z,
+			fabsf(M[0][2]) * e.x + fabsf(M[1][2]) * e.y + fabsf(M[2][2]) * e.z);
+		return AABB(vec3(wc.x, wc.y, wc.z) - we, vec3(wc.x, wc.y, wc.z) + we);
+	}
+
+	bool operator==(const AABB& b) const {
+		return lo.x == b.lo.x && lo.y == b.lo.y && lo.z == b.lo.z && hi.x == b.hi.x && hi.y == b.hi.y && hi.z == b.hi.z;
+	}
+};
+
+struct Frustum {	// planes of the view volume in world space, inside where dot(plane, (p, 1)) >= 0
+	enum Side { Outside, Intersecting, Inside };
+	vec4 planes[6];
+
+	Frustum(const mat4& VP) {	// from the columns of V * P: -w <= x, y, z <= w in clip space
+		for (int axis = 0; axis < 3; axis++) {
+			for (int sign = 0; sign < 2; sign++) {
+				float s = sign ? -1.0f : 1.0f;
+				planes[2 * axis + sign] = vec4(VP[0][3] + s * VP[0][axis], VP[1][3] + s * VP[1][axis],
+					VP[2][3] + s * VP[2][axis], VP[3][3] + s * VP[3][axis]);
+			}
+		}
+	}
+
+	Side Classify(const AABB& box) const {
+		Side side = Inside;
+		for (const vec4& p : planes) {
+			vec3 farthest(p.x >= 0 ? box.hi.x : box.lo.x, p.y >= 0 ? box.hi.y : box.lo.y, p.z >= 0 ? box.hi.z : box.lo.z);
+			vec3 nearest(p.x >= 0 ? box.lo.x : box.hi.x, p.y >= 0 ? box.lo.y : box.hi.y, p.z >= 0 ? box.lo.z : box.hi.z);
+			if (p.x * farthest.x + p.y * farthest.y + p.z * farthest.z + p.w < 0) return Outside;
+			if (p.x * nearest.x + p.y * nearest.y + p.z * nearest.z + p.w < 0) side = Intersecting;
+		}
+		return side;
+	}
+};
+
+const unsigned int lightBinding = 0, materialBinding = 1;	// uniform buffer binding points
+const unsigned int lightsUnit = 1, clusterRangesUnit = 2, clusterLightsUnit = 3;	// texture units of the light grid
+const int clustersX = 16, clustersY = 16, clustersZ = 24;	// light clusters: screen tiles and exponential depth slices
+
+inline int NextSortId() {	// small numbers for the sort keys of the render queue
+	static int next = 0;
+	return next++;
+}
+
 struct Material {
 	vec3 kd, ks, ka;
 	float shininess;
+	UniformBuffer block;	// uploaded at the first Bind, call Upload again after changing the parameters
+	const int sortId;
+
+	Material() : sortId(NextSortId()) { }
+
+	void Upload() {
+		struct {	// std140 layout of MaterialBlock
+			vec3 kd; float pad0;
+			vec3 ks; float pad1;
+			vec3 ka; float shininess;
+		} data = { kd, 0, ks, 0, ka, shininess };
+		block.upload(&data, sizeof(data));
+	}
+
+	void Bind() {
+		if (block.getId() == 0) Upload();
+		block.bind(materialBinding);
+	}
 };
 
 struct Light {
 	vec3 La, Le;
 	vec4 wLightPos;
 	vec4 direction;
+	float range = 0;	// the light fades out at this distance, 0 reaches everything
+	float cosCone = -2;	// cosine of the half angle of a spot light, below -1 for lights shining in every direction
+};
+
+struct LightLayout {	// what a specialized Phong shader is compiled for, the light grid orders its lights by kind
+	enum Kind { Directional, Spot, Point };
+	int nDirectional = 0;			// lights without range and cone, shaded on every fragment
+	std::vector<float> spotCones;	// cosines of the half angles of the spot lights, shaded on every fragment
+	bool clustered = true;			// point lights come from the cluster of the fragment, all of them are shaded otherwise
+	std::string defines;			// of the shader variant
+
+	static Kind KindOf(const Light& light) {
+		if (light.cosCone >= -1) return Spot;
+		return (light.range > 0 && light.wLightPos.w != 0) ? Point : Directional;
+	}
+
+	LightLayout() { }
+
+	LightLayout(const std::vector<Light>& lights, bool _clustered) : clustered(_clustered) {
+		for (const Light& light : lights) {
+			if (KindOf(light) == Directional) nDirectional++;
+			if (KindOf(light) == Spot) spotCones.push_back(light.cosCone);
+		}
+		defines = "#define DIRECTIONAL_LIGHTS " + std::to_string(nDirectional) + "\n#define SPOT_LIGHTS " + std::to_string(spotCones.size()) + "\n";
+		if (!spotCones.empty()) {
+			defines += "#define SPOT_CONES ";
+			for (size_t i = 0; i < spotCones.size(); i++) {
+				char number[32];
+				snprintf(number, sizeof(number), "%.9g", spotCones[i]);
+				if (!strpbrk(number, ".e")) strcat(number, ".0");	// float literal for the float array constructor
+				defines += (i > 0) ? std::string(", ") + number : std::string(number);
+			}
+			defines += "\n";
+		}
+		if (clustered) defines += "#define CLUSTERED\n";
+	}
+};
+
+class LightGrid {	// lights of the frame binned into view space clusters, a fragment shades only the lights of its cluster
+	struct Bounds {	// clusters a light may reach, with its bounding sphere in view space
+		int x0, x1, y0, y1, z0, z1;
+		vec3 center;
+		float radius;	// negative for lights reaching everything
+	};
+	std::vector<vec4> texels;		// 4 per light: La and range, Le and cosCone, wLightPos, direction
+	std::vector<Bounds> bounds;
+	std::vector<std::vector<unsigned int>> sliceLights;	// light indices of the clusters of a depth slice, one after the other
+	std::vector<unsigned int> ranges;	// first index and count of the lights per cluster
+	std::vector<unsigned int> indices;
+	TextureBuffer lightBuffer{ GL_RGBA32F }, rangeBuffer{ GL_RG32UI }, indexBuffer{ GL_R32UI };
+	UniformBuffer block;
+	LightLayout layout;
+	std::vector<int> order;	// scene lights in the order of the light buffer: directional, spot, then point lights
+
+	void Bin(int firstPoint, int nLights, Camera& camera) {	// only point lights have a range to bin by
+		mat4 V = camera.V();
+		float tanY = tanf(camera.fov / 2), tanX = tanY * camera.asp;
+		float depthRatio = camera.bp / camera.fp;
+		float sliceScale = clustersZ / logf(depthRatio), sliceBias = -logf(camera.fp) * sliceScale;
+		auto slice = [&](float depth) {	// clamped to the frustum before the log, depth may be 0 or negative
+			int z = (int)floorf(logf(fminf(fmaxf(depth, camera.fp), camera.bp)) * sliceScale + sliceBias);
+			return (z < 0) ? 0 : (z >= clustersZ) ? clustersZ - 1 : z;
+		};
+		auto tile = [](float ndc, int n) {	// clamped before the cast, ndc is unbounded near the eye plane
+			int t = (int)floorf((fminf(fmaxf(ndc, -1), 1) + 1) / 2 * n);
+			return (t < 0) ? 0 : (t >= n) ? n - 1 : t;
+		};
+
+		bounds.resize(nLights);
+		threadPool().parallelFor(firstPoint, nLights, [&](int i) {
+			Bounds& b = bounds[i];
+			b = Bounds{ 0, clustersX - 1, 0, clustersY - 1, 0, clustersZ - 1, vec3(0, 0, 0), -1 };
+			vec4 wLightPos = texels[4 * i + 2];
+			float range = texels[4 * i].w;
+			if (range <= 0 || wLightPos.w == 0) return;	// directional or unbounded
+			vec4 c = vec4(wLightPos.x / wLightPos.w, wLightPos.y / wLightPos.w, wLightPos.z / wLightPos.w, 1) * V;
+			b.center = vec3(c.x, c.y, c.z);
+			b.radius = range;
+			float nearDepth = -c.z - range, farDepth = -c.z + range;
+			if (farDepth < camera.fp || nearDepth > camera.bp) {	// outside of the depth range of the frustum
+				b.z0 = 1; b.z1 = 0;
+				return;
+			}
+			b.z0 = slice(nearDepth);
+			b.z1 = slice(farDepth);
+			if (nearDepth <= 0) return;	// the sphere reaches the plane of the eye, any tile can see it
+			float x0 = c.x - range, x1 = c.x + range, y0 = c.y - range, y1 = c.y + range;	// extremes of x/depth, y/depth
+			b.x0 = tile(x0 / ((x0 < 0) ? nearDepth : farDepth) / tanX, clustersX);
+			b.x1 = tile(x1 / ((x1 > 0) ? nearDepth : farDepth) / tanX, clustersX);
+			b.y0 = tile(y0 / ((y0 < 0) ? nearDepth : farDepth) / tanY, clustersY);
+			b.y1 = tile(y1 / ((y1 > 0) ? nearDepth : farDepth) / tanY, clustersY);
+		}, 16);
+
+		sliceLights.resize(clustersZ);
+		ranges.resize(2 * clustersX * clustersY * clustersZ);
+		threadPool().parallelFor(0, clustersZ, [&](int z) {	// slices are independent, each writes only its clusters
+			float d0 = camera.fp * powf(depthRatio, (float)z / clustersZ), d1 = camera.fp * powf(depthRatio, (float)(z + 1) / clustersZ);
+			std::vector<unsigned int> candidates;
+			for (int i = firstPoint; i < nLights; i++) if (bounds[i].z0 <= z && z <= bounds[i].z1) candidates.push_back(i);
+			std::vector<unsigned int>& list = sliceLights[z];
+			list.clear();
+			for (int y = 0; y < clustersY; y++) {
+				float ty0 = (2.0f * y / clustersY - 1) * tanY, ty1 = (2.0f * (y + 1) / clustersY - 1) * tanY;
+				for (int x = 0; x < clustersX; x++) {
+					float tx0 = (2.0f * x / clustersX - 1) * tanX, tx1 = (2.0f * (x + 1) / clustersX - 1) * tanX;
+					vec3 lo(fminf(tx0 * d0, tx0 * d1), fminf(ty0 * d0, ty0 * d1), -d1);	// box of the cluster in view space
+					vec3 hi(fmaxf(tx1 * d0, tx1 * d1), fmaxf(ty1 * d0, ty1 * d1), -d0);
+					int cluster = (z * clustersY + y) * clustersX + x;
+					ranges[2 * cluster] = (unsigned int)list.size();
+					for (unsigned int i : candidates) {
+						const Bounds& b = bounds[i];
+						if (x < b.x0 || x > b.x1 || y < b.y0 || y > b.y1) continue;
+						if (b.radius > 0) {	// sphere against the box
+							vec3 d = b.center - vec3(fmaxf(lo.x, fminf(b.center.x, hi.x)), fmaxf(lo.y, fminf(b.center.y, hi.y)), fmaxf(lo.z, fminf(b.center.z, hi.z)));
+							if (dot(d, d) > b.radius * b.radius) continue;
+						}
+						list.push_back(i);
+					}
+					ranges[2 * cluster + 1] = (unsigned int)list.size() - ranges[2 * cluster];
+				}
+			}
+		}, 1);
+
+		indices.clear();
+		for (int z = 0; z < clustersZ; z++) {	// concatenate the slices
+			unsigned int offset = (unsigned int)indices.size();
+			for (int cluster = z * clustersX * clustersY; cluster < (z + 1) * clustersX * clustersY; cluster++) ranges[2 * cluster] += offset;
+			indices.insert(indices.end(), sliceLights[z].begin(), sliceLights[z].end());
+		}
+	}
+
+public:
+	bool clustered = true;	// all the lights are shaded on every fragment otherwise
+
+	void Update(const std::vector<Light>& lights, Camera& camera) {
+		int nLights = (int)lights.size();
+		layout = LightLayout(lights, clustered);
+		order.clear();
+		for (int kind = LightLayout::Directional; kind <= LightLayout::Point; kind++)
+			for (int i = 0; i < nLights; i++) if (LightLayout::KindOf(lights[i]) == kind) order.push_back(i);
+		texels.resize(4 * nLights);
+		for (int k = 0; k < nLights; k++) {
+			const Light& light = lights[order[k]];
+			texels[4 * k] = vec4(light.La.x, light.La.y, light.La.z, light.range);
+			texels[4 * k + 1] = vec4(light.Le.x, light.Le.y, light.Le.z, light.cosCone);
+			texels[4 * k + 2] = light.wLightPos;
+			texels[4 * k + 3] = light.direction;
+		}
+		lightBuffer.upload(texels.data(), texels.size() * sizeof(vec4));
+		if (clustered) {
+			Bin(layout.nDirectional + (int)layout.spotCones.size(), nLights, camera);
+			rangeBuffer.upload(ranges.data(), ranges.size() * sizeof(unsigned int));
+			indexBuffer.upload(indices.data(), indices.size() * sizeof(unsigned int));
+		}
+
+		float sliceScale = clustersZ / logf(camera.bp / camera.fp);
+		struct {	// std140 layout of LightGrid
+			vec4 clusterScale;
+			int gridSize[4];
+			int nLights, pad[3];
+		} data = { vec4((float)clustersX / windowWidth, (float)clustersY / windowHeight, sliceScale, -logf(camera.fp) * sliceScale),
+			{ clustersX, clustersY, clustersZ, 0 }, nLights, { 0, 0, 0 } };
+		block.upload(&data, sizeof(data));
+	}
+
+	const LightLayout& Layout() const { return layout; }
+
+	void Bind() {
+		block.bind(lightBinding);
+		lightBuffer.bind(lightsUnit);
+		rangeBuffer.bind(clusterRangesUnit);
+		indexBuffer.bind(clusterLightsUnit);
+	}
+
+	void Release() {	// while the context is current
+		block.release();
+		lightBuffer.release();
+		rangeBuffer.release();
+		indexBuffer.release();
+	}
 };
 
 struct RenderState {
-	mat4 MVP, M, Minv, V, P;
-	Material* material;
-	std::vector<Light> lights;
+	mat4 MVP, M, V, P;
+	mat3 Normal;	// NormalMatrix(M)
 	vec3 wEye;
+	const LightLayout* lightLayout;	// of the lights in the light grid of the frame
 };
 
-class Shader : public GPUProgram {
+struct Transform {	// scaling, then rotation around the axis, then translation
+	vec3 scale, translation, rotationAxis;
+	float rotationAngle;
+
+	Transform(vec3 _scale = vec3(1, 1, 1), vec3 _translation = vec3(0, 0, 0), vec3 _rotationAxis = vec3(0, 0, 1), float _rotationAngle = 0) :
+		scale(_scale), translation(_translation), rotationAxis(_rotationAxis), rotationAngle(_rotationAngle) { }
+
+	bool operator==(const Transform& t) const {
+		return scale.x == t.scale.x && scale.y == t.scale.y && scale.z == t.scale.z &&
+			translation.x == t.translation.x && translation.y == t.translation.y && translation.z == t.translation.z &&
+			rotationAxis.x == t.rotationAxis.x && rotationAxis.y == t.rotationAxis.y && rotationAxis.z == t.rotationAxis.z &&
+			rotationAngle == t.rotationAngle;
+	}
+
+	mat4 Matrix() const {	// the product of the scale, rotation and translation matrices, written out
+		mat4 R = RotationMatrix(rotationAngle, rotationAxis);
+		return mat4(R[0] * scale.x, R[1] * scale.y, R[2] * scale.z, vec4(translation.x, translation.y, translation.z, 1));
+	}
+};
+
+// Parent/child hierarchy of transformations. A node is placed by its local transformation in the frame of its parent,
+// the world matrices are cached and only the changed nodes and their descendants are recomputed. Parents are added
+// before their children, so one pass in index order visits every parent first.
+class SceneGraph {
+	std::vector<int> parents;			// -1 for the roots
+	std::vector<Transform> locals;
+	std::vector<mat4> worlds;			// cached modeling transformations, AffineInverse and NormalMatrix give the rest
+	std::vector<char> dirty;			// local transformation changed since the last Update
+	std::vector<char> changed;			// world matrix recomputed by the last Update
 public:
-	virtual void Bind(RenderState state) = 0;
+	int AddNode(int parent, const Transform& local = Transform()) {
+		int node = (int)parents.size();
+		if (parent >= node) {
+			printf("Scene graph: the parent of node %d has to be added before it\n", node);
+			parent = -1;
+		}
+		parents.push_back(parent);
+		locals.push_back(local);
+		worlds.push_back(mat4());
+		dirty.push_back(1);
+		changed.push_back(0);
+		return node;
+	}
+
+	int size() const { return (int)parents.size(); }
+	int Parent(int node) const { return parents[node]; }
+	const Transform& Local(int node) const { return locals[node]; }
+	const std::vector<Transform>& Locals() const { return locals; }
 
-	void setUniformMaterial(const Material& material, const std::string& name) {
-		setUniform(material.kd, name + ".kd");
-		setUniform(material.ks, name + ".ks");
-		setUniform(material.ka, name + ".ka");
-		setUniform(material.shininess, name + ".shininess");
+	void SetLocal(int node, const Transform& local) {	// setting the same value keeps the cache
+		if (locals[node] == local) return;
+		locals[node] = local;
+		dirty[node] = 1;
 	}
 
-	void setUniformLight(const Light& light, const std::string& name) {
-		setUniform(light.La, name + ".La");
-		setUniform(light.Le, name + ".Le");
-		setUniform(light.wLightPos, name + ".wLightPos");
-		setUniform(light.direction, name + ".direction");
+	void Update() {	// recompute the world matrices of the changed nodes and their descendants
+		for (size_t i = 0; i < parents.size(); i++) {
+			int parent = parents[i];
+			if (parent >= 0 && dirty[parent]) dirty[i] = 1;
+			if (!dirty[i]) continue;
+			worlds[i] = (parent >= 0) ? locals[i].Matrix() * worlds[parent] : locals[i].Matrix();
+		}
+		changed.swap(dirty);
+		std::fill(dirty.begin(), dirty.end(), 0);
 	}
+
+	bool Changed(int node) const { return changed[node] != 0; }
+
+	const mat4& World(int node) const { return worlds[node]; }
+	vec3 Position(int node) const { return vec3(worlds[node][3][0], worlds[node][3][1], worlds[node][3][2]); }	// origin of the node in world space
+};
+
+class BVH {	// bounding volume hierarchy over the world boxes of items, built once and refit as the items move
+	struct Node {
+		AABB box;
+		int left, right;	// children, -1 for leaves
+		int first, count;	// items of a leaf
+	};
+	std::vector<Node> nodes;	// children come after their parent
+	std::vector<int> items;		// leaves index ranges of this
+	std::vector<AABB> boxes;	// per item
+	std::vector<int> leafOf;	// per item
+	std::vector<char> dirty;	// per node, a box below changed since the last Refit
+	static const int leafSize = 4;
+
+	int Build(int first, int count) {	// median split of the centers along the longest axis
+		int index = (int)nodes.size();
+		nodes.push_back(Node{ AABB(), -1, -1, first, count });
+		AABB bounds, centers;
+		for (int i = first; i < first + count; i++) {
+			bounds.Grow(boxes[items[i]]);
+			vec3 c = (boxes[items[i]].lo + boxes[items[i]].hi) * 0.5f;
+			centers.Grow(AABB(c, c));
+		}
+		nodes[index].box = bounds;
+		if (count <= leafSize) {
+			for (int i = first; i < first + count; i++) leafOf[items[i]] = index;
+			return index;
+		}
+		vec3 extent = centers.hi - centers.lo;
+		int axis = (extent.x >= extent.y && extent.x >= extent.z) ? 0 : (extent.y >= extent.z) ? 1 : 2;
+		auto center = [&](int item) { return (&boxes[item].lo.x)[axis] + (&boxes[item].hi.x)[axis]; };
+		std::nth_element(items.begin() + first, items.begin() + first + count / 2, items.begin() + first + count,
+			[&](int a, int b) { return center(a) < center(b); });
+		int left = Build(first, count / 2);
+		int right = Build(first + count / 2, count - count / 2);
+		nodes[index].left = left;
+		nodes[index].right = right;
+		return index;
+	}
+
+public:
+	int size() const { return (int)boxes.size(); }
+	const AABB& Box(int item) const { return boxes[item]; }
+
+	void Build(const std::vector<AABB>& itemBoxes) {
+		boxes = itemBoxes;
+		items.resize(boxes.size());
+		for (size_t i = 0; i < items.size(); i++) items[i] = (int)i;
+		leafOf.assign(boxes.size(), -1);
+		nodes.clear();
+		if (!boxes.empty()) Build(0, (int)boxes.size());
+		dirty.assign(nodes.size(), 0);
+	}
+
+	void Update(int item, const AABB& box) {	// new world box of an item, applied by Refit
+		if (boxes[item] == box) return;
+		boxes[item] = box;
+		dirty[leafOf[item]] = 1;
+	}
+
+	void Refit() {	// recompute the boxes above the changed items, children first
+		for (int i = (int)nodes.size() - 1; i >= 0; i--) {
+			Node& node = nodes[i];
+			if (node.left >= 0 && (dirty[node.left] || dirty[node.right])) dirty[i] = 1;
+			if (!dirty[i]) continue;
+			node.box = AABB();
+			if (node.left >= 0) {
+				node.box.Grow(nodes[node.left].box);
+				node.box.Grow(nodes[node.right].box);
+			}
+			else for (int k = node.first; k < node.first + node.count; k++) node.box.Grow(boxes[items[k]]);
+		}
+		std::fill(dirty.begin(), dirty.end(), 0);
+	}
+
+	template<class F> void Query(const Frustum& frustum, F visible) {	// calls visible(item) for the items in the frustum
+		if (nodes.empty()) return;
+		struct Entry {
+			int node;
+			bool inside;	// the parent is inside the frustum, nothing below needs a test
+		} stack[64];		// deeper than the median split tree of any item count
+		int top = 0;
+		stack[top++] = Entry{ 0, false };
+		while (top > 0) {
+			Entry entry = stack[--top];
+			const Node& node = nodes[entry.node];
+			bool inside = entry.inside;
+			if (!inside) {
+				Frustum::Side side = frustum.Classify(node.box);
+				if (side == Frustum::Outside) continue;
+				inside = (side == Frustum::Inside);
+			}
+			if (node.left >= 0) {
+				stack[top++] = Entry{ node.right, inside };
+				stack[top++] = Entry{ node.left, inside };
+				continue;
+			}
+			for (int k = node.first; k < node.first + node.count; k++)
+				if (inside || frustum.Classify(boxes[items[k]]) != Frustum::Outside) visible(items[k]);
+		}
+	}
+};
+
+inline vec3 lerp(const vec3& a, const vec3& b, float t) { return a + (b - a) * t; }
+inline vec4 lerp(const vec4& a, const vec4& b, float t) { return a + (b - a) * t; }
+
+struct Snapshot {	// simulated state of the scene at a time, everything the rendering needs
+	double time;
+	std::vector<Transform> transforms;	// local transformations, one per scene graph node
+	std::vector<Light> lights;
+	Camera camera;
+
+	Snapshot() { time = 0; }
+
+	void Interpolate(const Snapshot& a, const Snapshot& b, float t) {	// blend of a and b, t = 0 gives a
+		time = a.time + (b.time - a.time) * t;
+		transforms.resize(b.transforms.size());
+		for (size_t i = 0; i < b.transforms.size(); i++) {
+			transforms[i] = b.transforms[i];
+			transforms[i].scale = lerp(a.transforms[i].scale, b.transforms[i].scale, t);
+			transforms[i].translation = lerp(a.transforms[i].translation, b.transforms[i].translation, t);
+			transforms[i].rotationAngle = a.transforms[i].rotationAngle + (b.transforms[i].rotationAngle - a.transforms[i].rotationAngle) * t;
+		}
+		lights = b.lights;
+		for (size_t i = 0; i < b.lights.size(); i++) {
+			lights[i].wLightPos = lerp(a.lights[i].wLightPos, b.lights[i].wLightPos, t);
+			lights[i].direction = lerp(a.lights[i].direction, b.lights[i].direction, t);
+		}
+		camera = b.camera;
+		camera.wEye = lerp(a.camera.wEye, b.camera.wEye, t);
+	}
+};
+
+struct InstanceData {	// per instance vertex attributes of instanced drawing
+	mat4 M;
+	mat3 Normal;
+};
+
+const int instanceAttribute = 3;	// first attribute location of InstanceData, one per matrix row
+const int decodeAttribute = 10;		// two attributes, constant per geometry, decoding the vertex format
+
+class Shader : public GPUProgram {
+protected:
+public:
+	const int sortId;
+
+	Shader() : sortId(NextSortId()) { }
+	virtual void Bind(const RenderState& state) = 0;			// the program and the uniforms shared by the objects
+	virtual void SetTransform(const RenderState& state) = 0;	// per object uniforms, after Bind
+	virtual void BindInstanced(const RenderState& state) = 0;	// per object transformations come from InstanceData
 };
 
 class PhongShader : public Shader {
@@ -113,137 +709,353 @@ class PhongShader : public Shader {
 		#version 330
 		precision highp float;
  
-		struct Light {
-			vec3 La, Le;
-			vec4 wLightPos;
-			vec4 direction;
-		};
- 
-		uniform mat4  MVP, M, Minv; 
-		uniform Light[8] lights;    
-		uniform int   nLights;
+#ifdef INSTANCED
+		uniform mat4  VP;
+		layout(location = 3) in vec4 instM[4];	// rows of M
+		layout(location = 7) in vec3 instNormal[3];	// rows of the normal matrix
+#else
+		uniform mat4  MVP, M; 
+		uniform mat3  Normal;	// inverse transpose of M
+#endif
 		uniform vec3  wEye;       
  
 		layout(location = 0) in vec3  vtxPos;            
-		layout(location = 1) in vec3  vtxNorm;      	 
+		layout(location = 1) in vec4  vtxNorm;	// xyz, or octahedral xy in the packed format
 		layout(location = 2) in vec2  vtxUV;
+		layout(location = 10) in vec4 posScale;	// position = vtxPos * scale + offset, w is 1 for octahedral normals
+		layout(location = 11) in vec3 posOffset;
  
 		out vec3 wNormal;		    
 		out vec3 wView;             
-		out vec3 wLight[8];
 		out vec4 wPos;		   
+		out float viewDepth;	// distance from the eye along the view direction
+
+		vec3 OctDecode(vec2 e) {	// folds the lower half of the octahedron back from the corners of the square
+			vec3 n = vec3(e, 1 - abs(e.x) - abs(e.y));
+			float t = max(-n.z, 0);
+			n.xy -= sign(n.xy) * t;
+			return n;
+		}
  
 		void main() {
-			gl_Position = vec4(vtxPos, 1) * MVP; 
-			wPos = vec4(vtxPos, 1) * M;
-			for(int i = 0; i < nLights; i++) {
-				wLight[i] = lights[i].wLightPos.xyz * wPos.w - wPos.xyz * lights[i].wLightPos.w;
-			}
+			vec3 position = vtxPos * posScale.xyz + posOffset;
+			vec3 normal = (posScale.w > 0) ? OctDecode(vtxNorm.xy) : vtxNorm.xyz;
+#ifdef INSTANCED
+			mat4 M = transpose(mat4(instM[0], instM[1], instM[2], instM[3]));
+			mat3 Normal = transpose(mat3(instNormal[0], instNormal[1], instNormal[2]));
+			wPos = vec4(position, 1) * M;
+			gl_Position = wPos * VP;
+#else
+			gl_Position = vec4(position, 1) * MVP; 
+			wPos = vec4(position, 1) * M;
+#endif
+			viewDepth = gl_Position.w;
 		    wView  = wEye * wPos.w - wPos.xyz;
-		    wNormal = (Minv * vec4(vtxNorm, 0)).xyz;
+		    wNormal = normal * Normal;
 		}
 	)";
 
+	// Variants are specialized by defines: DIRECTIONAL_LIGHTS and SPOT_LIGHTS count the lights shaded on every
+	// fragment, first in lightData, SPOT_CONES lists the cosines of the spot cones, with CLUSTERED the point lights
+	// come from the cluster of the fragment. The kinds of the lights and the cone angles need no branches or math.
 	const char* fragmentSource = R"(
 		#version 330
 		precision highp float;
+
+#ifndef DIRECTIONAL_LIGHTS
+#define DIRECTIONAL_LIGHTS 0
+#endif
+#ifndef SPOT_LIGHTS
+#define SPOT_LIGHTS 0
+#endif
  
-		struct Light {
-			vec3 La, Le;
-			vec4 wLightPos;
-			vec4 direction;
+		uniform samplerBuffer  lightData;		// 4 texels per light: La and range, Le and cosine of the cone, wLightPos, direction
+#ifdef CLUSTERED
+		uniform usamplerBuffer clusterRanges;	// first index and count of the lights of a cluster
+		uniform usamplerBuffer clusterLights;	// light indices of the clusters
+#endif
+
+		layout(std140) uniform LightGrid {
+			vec4  clusterScale;	// xy: clusters per pixel, z: slices per log depth, w: slice of depth 1
+			ivec4 gridSize;		// clusters along x, y and z
+			int   nLights;
 		};
- 
-		struct Material {
+
+		layout(std140) uniform MaterialBlock {
 			vec3 kd, ks, ka;
 			float shininess;
-		};
- 
-		uniform Material material;
-		uniform Light[8] lights;   
-		uniform int   nLights;
+		} material;
  
 		in  vec3 wNormal;       
 		in  vec3 wView;         
-		in  vec3 wLight[8];   
 		in  vec4 wPos; 
+		in  float viewDepth;
 		
         out vec4 fragmentColor; 
+
+		vec3 Reflect(vec4 La, vec4 Le, vec3 wLight, vec3 N, vec3 V) {
+			vec3 L = normalize(wLight);
+			vec3 H = normalize(L + V);
+			float cost = max(dot(N,L), 0), cosd = max(dot(N,H), 0);
+			return material.ka * La.rgb + (material.kd * cost + material.ks * pow(cosd, material.shininess)) * Le.rgb;
+		}
+
+		float Window(vec3 wLight, float range) {	// smooth fade reaching 0 at the range of the light
+			float d = length(wLight) / range;
+			float window = clamp(1 - d * d * d * d, 0, 1);
+			return window * window;
+		}
+
+		vec3 ShadeDirectional(int i, vec3 N, vec3 V) {
+			vec4 wLightPos = texelFetch(lightData, 4 * i + 2);
+			return Reflect(texelFetch(lightData, 4 * i), texelFetch(lightData, 4 * i + 1), wLightPos.xyz * wPos.w - wPos.xyz * wLightPos.w, N, V);
+		}
+
+		vec3 ShadeSpot(int i, float cosCone, vec3 N, vec3 V) {
+			vec4 La = texelFetch(lightData, 4 * i), wLightPos = texelFetch(lightData, 4 * i + 2), direction = texelFetch(lightData, 4 * i + 3);
+			vec3 wLight = wLightPos.xyz * wPos.w - wPos.xyz * wLightPos.w;
+			float inside = float(dot(normalize(direction.xyz - wPos.xyz), normalize(-direction.xyz)) > cosCone);
+			float attenuation = (La.w > 0) ? Window(wLight, La.w) : 1.0;
+			return Reflect(La, texelFetch(lightData, 4 * i + 1), wLight, N, V) * (inside * attenuation);
+		}
+
+		vec3 ShadePoint(int i, vec3 N, vec3 V) {
+			vec4 La = texelFetch(lightData, 4 * i), wLightPos = texelFetch(lightData, 4 * i + 2);
+			vec3 wLight = wLightPos.xyz * wPos.w - wPos.xyz * wLightPos.w;
+			return Reflect(La, texelFetch(lightData, 4 * i + 1), wLight, N, V) * Window(wLight, La.w);
+		}
  
-	void main() {
+		void main() {
 			vec3 N = normalize(wNormal);
 			vec3 V = normalize(wView); 
 			if (dot(N, V) < 0) N = -N;			
-			vec3 ka = material.ka;
-			vec3 kd = material.kd;
  
 			vec3 radiance = vec3(0, 0, 0);
-			for(int i = 0; i < nLights; i++) {
-				vec3 L = normalize(wLight[i]);
-				vec3 H = normalize(L + V);
-				float cost = max(dot(N,L), 0), cosd = max(dot(N,H), 0);
-					if(i == 1){  //1es a lampa fenye					
-						vec3 lightDirection = normalize(lights[1].direction.xyz - wPos.xyz);
-						float theta = dot(lightDirection, normalize(-lights[1].direction.xyz));
-						float angle =  cos(0.33333333333 * 3.14159265);   //fix szogmeret (60deg)  
- 
-						if(theta > angle){
-							radiance += ka * lights[i].La + (kd * cost + material.ks * pow(cosd, material.shininess)) * lights[i].Le;
-						}
-						else {}
-					}				
-						else {radiance += ka * lights[i].La + (kd * cost + material.ks * pow(cosd, material.shininess)) * lights[i].Le;
-							 }
-            }
+#if DIRECTIONAL_LIGHTS > 0
+			for(int i = 0; i < DIRECTIONAL_LIGHTS; i++) radiance += ShadeDirectional(i, N, V);
+#endif
+#if SPOT_LIGHTS > 0
+			const float spotCones[SPOT_LIGHTS] = float[SPOT_LIGHTS](SPOT_CONES);
+			for(int i = 0; i < SPOT_LIGHTS; i++) radiance += ShadeSpot(DIRECTIONAL_LIGHTS + i, spotCones[i], N, V);
+#endif
+#ifdef CLUSTERED
+			vec3 cell = vec3(gl_FragCoord.xy * clusterScale.xy, log(viewDepth) * clusterScale.z + clusterScale.w);
+			ivec3 c = clamp(ivec3(cell), ivec3(0), gridSize.xyz - 1);
+			uvec2 range = texelFetch(clusterRanges, (c.z * gridSize.y + c.y) * gridSize.x + c.x).xy;
+			for(uint k = 0u; k < range.y; k++) radiance += ShadePoint(int(texelFetch(clusterLights, int(range.x + k)).r), N, V);
+#else
+			for(int i = DIRECTIONAL_LIGHTS + SPOT_LIGHTS; i < nLights; i++) radiance += ShadePoint(i, N, V);
+#endif
 			fragmentColor = vec4(radiance, 1);
 		}
 	)";
-public:
-	PhongShader() { create(vertexSource, fragmentSource, "fragmentColor"); }
 
-	void Bind(RenderState state) {
-		Use();
-		setUniform(state.MVP, "MVP");
-		setUniform(state.M, "M");
-		setUniform(state.Minv, "Minv");
-		setUniform(state.wEye, "wEye");
-		setUniformMaterial(*state.material, "material");
+	struct Variant {	// program of a light layout, with or without instancing, and its uniform locations
+		GPUProgram* program;
+		int mvpLocation, mLocation, normalLocation, vpLocation, wEyeLocation;
+	};
+	std::unordered_map<std::string, Variant> variants[2];	// ready programs by the light defines, without and with instancing
+	Variant* lastReady[2] = { nullptr, nullptr };	// drawn while the variant of a new layout compiles
+	std::vector<const GPUProgram*> failed;		// their diagnostics are printed once
+	Variant* current = nullptr;	// of the last Bind, nullptr if no variant could be built
 
-		setUniform((int)state.lights.size(), "nLights");
-		for (unsigned int i = 0; i < state.lights.size(); i++) {
-			setUniformLight(state.lights[i], std::string("lights[") + std::to_string(i) + std::string("]"));
+	static std::string Defines(const LightLayout& layout, bool instanced) {
+		return (instanced ? "#define INSTANCED\n" : "") + layout.defines;
+	}
+
+	// A new layout does not stall the frame: its variant is started, and the last ready variant is drawn until it links.
+	// That shades the frames in between with the previous layout. Only the very first variant is waited for.
+	Variant* Select(const LightLayout& layout, bool instanced) {
+		auto found = variants[instanced].find(layout.defines);
+		if (found != variants[instanced].end()) return lastReady[instanced] = &found->second;
+
+		GPUProgram& program = variant(Defines(layout, instanced));	// usually started by Prepare, otherwise here
+		if (!program.isReady()) {
+			if (program.getStatus() == Compiling && lastReady[instanced]) return lastReady[instanced];
+			if (!program.finish()) {	// not cached, the last ready variant stays in use
+				if (std::find(failed.begin(), failed.end(), &program) == failed.end()) {
+					failed.push_back(&program);
+					for (const Diagnostic& diagnostic : program.getDiagnostics()) printf("Phong shader, %s error:\n%s", diagnostic.stage.c_str(), diagnostic.log.c_str());
+				}
+				return lastReady[instanced];
+			}
+		}
+		Variant v = { &program, -1, -1, -1, -1, -1 };
+		if (instanced) v.vpLocation = program.getLocation("VP");
+		else {
+			v.mvpLocation = program.getLocation("MVP");
+			v.mLocation = program.getLocation("M");
+			v.normalLocation = program.getLocation("Normal");
 		}
+		v.wEyeLocation = program.getLocation("wEye");
+		program.setUniformBlock("LightGrid", lightBinding);
+		program.setUniformBlock("MaterialBlock", materialBinding);
+		program.Use();	// texture units of the light grid
+		program.setUniform((int)lightsUnit, "lightData");
+		if (layout.clustered) {
+			program.setUniform((int)clusterRangesUnit, "clusterRanges");
+			program.setUniform((int)clusterLightsUnit, "clusterLights");
+		}
+		return lastReady[instanced] = &(variants[instanced][layout.defines] = v);
+	}
+
+public:
+	PhongShader() { setSources(vertexSource, fragmentSource, "fragmentColor"); }
+
+	void Prepare(const LightLayout& layout) {	// starts building the variants of a layout, they compile at the same time
+		variant(Defines(layout, false));
+		variant(Defines(layout, true));
+	}
+
+	void BindInstanced(const RenderState& state) {
+		current = Select(*state.lightLayout, true);
+		if (!current) { glState().useProgram(0); return; }	// nothing can be drawn
+		current->program->Use();
+		current->program->setUniform(state.V * state.P, current->vpLocation);
+		current->program->setUniform(state.wEye, current->wEyeLocation);
+	}
+
+	void Bind(const RenderState& state) {	// lights come from the LightGrid of the frame, material from its block
+		current = Select(*state.lightLayout, false);
+		if (!current) { glState().useProgram(0); return; }
+		current->program->Use();
+		current->program->setUniform(state.wEye, current->wEyeLocation);
+	}
+
+	void SetTransform(const RenderState& state) {
+		if (!current) return;
+		current->program->setUniform(state.MVP, current->mvpLocation);
+		current->program->setUniform(state.M, current->mLocation);
+		current->program->setUniform(state.Normal, current->normalLocation);
 	}
 };
 
 class Geometry {
 protected:
 	unsigned int vao, vbo;
+	unsigned int instanceVbo;	// InstanceData stream, created at the first instanced draw
 public:
-	Geometry() {
+	vec3 center;		// bounding sphere in modeling space
+	float radius;
+	AABB bounds;		// bounding box in modeling space
+	const int sortId;
+
+	Geometry() : sortId(NextSortId()) {
+		radius = 0;
+		instanceVbo = 0;
 		glGenVertexArrays(1, &vao);
-		glBindVertexArray(vao);
+		glState().bindVertexArray(vao);
 		glGenBuffers(1, &vbo);
 		glBindBuffer(GL_ARRAY_BUFFER, vbo);
 	}
-	virtual void Draw() = 0;
-	~Geometry() {
+	// detail level for a bounding sphere of pixelRadius on the screen, the level of the previous frame is given in lod
+	virtual int SelectLod(float pixelRadius, int lod) { return 0; }
+	virtual void Draw(int lod = 0) = 0;
+	virtual void DrawInstanced(int lod, int nInstances) = 0;
+
+	void SetInstances(const std::vector<InstanceData>& instances) {
+		glState().bindVertexArray(vao);
+		if (instanceVbo == 0) {
+			glGenBuffers(1, &instanceVbo);
+			glBindBuffer(GL_ARRAY_BUFFER, instanceVbo);
+			for (int row = 0; row < 7; row++) {	// 4 rows of M, then 3 rows of the normal matrix
+				glEnableVertexAttribArray(instanceAttribute + row);
+				if (row < 4) glVertexAttribPointer(instanceAttribute + row, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceData), (void*)(row * sizeof(vec4)));
+				else glVertexAttribPointer(instanceAttribute + row, 3, GL_FLOAT, GL_FALSE, sizeof(InstanceData), (void*)(offsetof(InstanceData, Normal) + (row - 4) * sizeof(vec3)));
+				glVertexAttribDivisor(instanceAttribute + row, 1);
+			}
+		}
+		glBindBuffer(GL_ARRAY_BUFFER, instanceVbo);
+		glBufferData(GL_ARRAY_BUFFER, instances.size() * sizeof(InstanceData), &instances[0], GL_STREAM_DRAW);
+	}
+
+	virtual ~Geometry() {
+		if (instanceVbo > 0) glDeleteBuffers(1, &instanceVbo);
 		glDeleteBuffers(1, &vbo);
 		glDeleteVertexArrays(1, &vao);
+		glState().invalidate();
 	}
 };
 
 class ParamSurface : public Geometry {
 	struct VertexData {
 		vec3 position, normal;
+		vec2 uv;
 	};
 
-	unsigned int nVtxPerStrip, nStrips;
+	struct PackedVertex {
+		unsigned short position[4];	// unsigned normalized in the bounds, the fourth pads to 8 bytes
+		unsigned int normal;		// octahedral xy in the x and y fields of GL_INT_2_10_10_10_REV
+		unsigned short uv[2];
+	};
+
+	struct MeshData {
+		std::vector<VertexData> vertices;
+		std::vector<unsigned int> indices;
+		MeshOptimizer::Stats grid, optimized;	// vertex cache statistics of the row by row and the optimized order
+	};
+
+	typedef std::tuple<std::type_index, int, int> MeshKey;	// surface type, N, M
+
+	static std::map<MeshKey, std::shared_ptr<const MeshData>>& meshCache() {
+		static std::map<MeshKey, std::shared_ptr<const MeshData>> cache;
+		return cache;
+	}
+
+	struct Lod {
+		int N, M;
+		unsigned int firstIndex, nIndices;
+		int baseVertex;
+	};
+
+	unsigned int ibo;
+	unsigned int decodeVbo;	// scale and offset of the positions, octahedral flag
+	std::vector<Lod> lods;	// from the finest to the coarsest
+
+	static unsigned short Unorm16(float f) { return (unsigned short)lroundf(fminf(fmaxf(f, 0), 1) * 65535); }
+	static unsigned int Snorm10(float f) { return (unsigned int)lroundf(fminf(fmaxf(f, -1), 1) * 511) & 0x3FF; }
+
+	static vec2 OctEncode(vec3 n) {	// projects onto the octahedron, the lower half is unfolded to the corners
+		n = n / (fabsf(n.x) + fabsf(n.y) + fabsf(n.z));
+		if (n.z >= 0) return vec2(n.x, n.y);
+		return vec2((1 - fabsf(n.y)) * (n.x >= 0 ? 1 : -1), (1 - fabsf(n.x)) * (n.y >= 0 ? 1 : -1));
+	}
+
+	static void Pack(const MeshData& m, vec3 lo, vec3 extent, PackedVertex* out) {
+		for (size_t v = 0; v < m.vertices.size(); v++) {
+			const VertexData& vd = m.vertices[v];
+			PackedVertex& pv = out[v];
+			vec3 q = vd.position - lo;
+			pv.position[0] = Unorm16(q.x / extent.x);
+			pv.position[1] = Unorm16(q.y / extent.y);
+			pv.position[2] = Unorm16(q.z / extent.z);
+			pv.position[3] = 0;
+			vec2 e = OctEncode((length(vd.normal) > 0) ? normalize(vd.normal) : vec3(0, 0, 1));
+			pv.normal = Snorm10(e.x) | Snorm10(e.y) << 10;
+			pv.uv[0] = Unorm16(vd.uv.x);
+			pv.uv[1] = Unorm16(vd.uv.y);
+		}
+	}
 public:
-	ParamSurface() { nVtxPerStrip = nStrips = 0; }
+	ParamSurface() {
+		glGenBuffers(1, &decodeVbo);
+		glGenBuffers(1, &ibo);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);	// the element buffer binding is part of the vao state
+	}
 
+	virtual const char* Name() = 0;
 	virtual void eval(Dnum2& U, Dnum2& V, Dnum2& X, Dnum2& Y, Dnum2& Z) = 0;
 
+	virtual void eval(Dnum2x8& U, Dnum2x8& V, Dnum2x8& X, Dnum2x8& Y, Dnum2x8& Z) {	// lane by lane, surfaces override it
+		for (int k = 0; k < nLanes; k++) {
+			Dnum2 u(U.f[k], vec2(U.dx[k], U.dy[k])), v(V.f[k], vec2(V.dx[k], V.dy[k])), x, y, z;
+			eval(u, v, x, y, z);
+			X.f[k] = x.f; X.dx[k] = x.d.x; X.dy[k] = x.d.y;
+			Y.f[k] = y.f; Y.dx[k] = y.d.x; Y.dy[k] = y.d.y;
+			Z.f[k] = z.f; Z.dx[k] = z.d.x; Z.dy[k] = z.d.y;
+		}
+	}
+
 	VertexData GenVertexData(float u, float v) {
 		VertexData vtxData;
 		Dnum2 X, Y, Z;
@@ -252,217 +1064,634 @@ public:
 		vtxData.position = vec3(X.f, Y.f, Z.f);
 		vec3 drdU(X.d.x, Y.d.x, Z.d.x), drdV(X.d.y, Y.d.y, Z.d.y);
 		vtxData.normal = cross(drdU, drdV);
+		vtxData.uv = vec2(u, v);
 		return vtxData;
 	}
 
-	void create(int N = tessellationLevel, int M = tessellationLevel) {
-		nVtxPerStrip = (M + 1) * 2;
-		nStrips = N;
-		std::vector<VertexData> vtxData;
+	void GenVertexRow(float v, int M, VertexData* row) {	// the M + 1 vertices at parameter v, nLanes per eval call
+		for (int j0 = 0; j0 <= M; j0 += nLanes) {
+			Dnum2x8 X, Y, Z, U, V(v);
+			for (int k = 0; k < nLanes; k++) {
+				U.f[k] = (float)((j0 + k <= M) ? j0 + k : M) / M;
+				U.dx[k] = 1; V.dy[k] = 1;
+			}
+			eval(U, V, X, Y, Z);
+			for (int k = 0; k < nLanes && j0 + k <= M; k++) {
+				row[j0 + k].position = vec3(X.f[k], Y.f[k], Z.f[k]);
+				vec3 drdU(X.dx[k], Y.dx[k], Z.dx[k]), drdV(X.dy[k], Y.dy[k], Z.dy[k]);
+				row[j0 + k].normal = cross(drdU, drdV);
+				row[j0 + k].uv = vec2(U.f[k], v);
+			}
+		}
+	}
+
+	std::shared_ptr<const MeshData> tessellate(int N, int M) {
+		auto data = std::make_shared<MeshData>();
+		data->vertices.resize((N + 1) * (M + 1));	// shared (N + 1) x (M + 1) grid, each point is evaluated once
+		threadPool().parallelFor(0, N + 1, [&](int i) {	// grid points are independent, rows go to the workers
+			GenVertexRow((float)i / N, M, &data->vertices[i * (M + 1)]);
+		}, 1 + 4096 / (M + 1));
+		const float degenerate = 1e-4f;	// the normals at the poles get the mean normal of the next row
+		for (int i = 0; i <= N; i++) {
+			VertexData* row = &data->vertices[i * (M + 1)];
+			if (length(row[0].normal) > degenerate) continue;
+			const VertexData* next = &data->vertices[(i < N ? i + 1 : i - 1) * (M + 1)];
+			vec3 sum(0, 0, 0);
+			for (int j = 0; j <= M; j++) sum = sum + next[j].normal;
+			for (int j = 0; j <= M; j++) if (length(row[j].normal) <= degenerate) row[j].normal = sum / (float)(M + 1);
+		}
+		data->indices.reserve(N * M * 6);	// two triangles per grid cell
 		for (int i = 0; i < N; i++) {
-			for (int j = 0; j <= M; j++) {
-				vtxData.push_back(GenVertexData((float)j / M, (float)i / N));
-				vtxData.push_back(GenVertexData((float)j / M, (float)(i + 1) / N));
+			for (int j = 0; j < M; j++) {
+				unsigned int i0 = i * (M + 1) + j, i1 = i0 + M + 1;
+				data->indices.push_back(i0); data->indices.push_back(i1); data->indices.push_back(i0 + 1);
+				data->indices.push_back(i0 + 1); data->indices.push_back(i1); data->indices.push_back(i1 + 1);
+			}
+		}
+
+		size_t nVertices = data->vertices.size();
+		data->grid = MeshOptimizer::Analyze(data->indices, nVertices);
+		MeshOptimizer::OptimizeVertexCache(data->indices, nVertices);
+		MeshOptimizer::OptimizeOverdraw(data->indices, &data->vertices[0].position, sizeof(VertexData), nVertices);
+		MeshOptimizer::RemapVertices(data->vertices, MeshOptimizer::OptimizeVertexFetch(data->indices, nVertices));
+		data->optimized = MeshOptimizer::Analyze(data->indices, nVertices);
+		return data;
+	}
+
+	std::shared_ptr<const MeshData> mesh(int N, int M, bool& tessellated) {
+		// called from the constructor of the concrete surface, so typeid and eval already see the derived class
+		std::shared_ptr<const MeshData>& cached = meshCache()[MeshKey(std::type_index(typeid(*this)), N, M)];
+		if (!cached) {
+			cached = tessellate(N, M);
+			tessellated = true;
+		}
+		return cached;
+	}
+
+	// level 0 is tessellated N x M, every further level halves it, all levels share one vertex and one index buffer
+	void create(VertexFormat format = PackedVertices, int N = tessellationLevel * 2, int M = tessellationLevel * 2, int levels = nLods) {
+		std::vector<std::shared_ptr<const MeshData>> meshes;
+		unsigned int nVertices = 0, nIndices = 0;
+		bool tessellated = false;
+		lods.clear();
+		for (int l = 0; l < levels && N >> l >= 2 && M >> l >= 2; l++) {
+			Lod lod = { N >> l, M >> l, nIndices, 0, (int)nVertices };
+			meshes.push_back(mesh(lod.N, lod.M, tessellated));
+			lod.nIndices = (unsigned int)meshes.back()->indices.size();
+			nVertices += (unsigned int)meshes.back()->vertices.size();
+			nIndices += lod.nIndices;
+			lods.push_back(lod);
+		}
+		if (tessellated) {	// transformed vertices of all levels, per triangle and per vertex
+			float gridMisses = 0, optimizedMisses = 0;
+			for (size_t l = 0; l < meshes.size(); l++) {
+				gridMisses += meshes[l]->grid.acmr * meshes[l]->indices.size() / 3;
+				optimizedMisses += meshes[l]->optimized.acmr * meshes[l]->indices.size() / 3;
+			}
+			printf("%s mesh, %d levels: ACMR %.3f -> %.3f, ATVR %.3f -> %.3f\n", Name(), (int)lods.size(),
+				gridMisses * 3 / nIndices, optimizedMisses * 3 / nIndices, gridMisses / nVertices, optimizedMisses / nVertices);
+		}
+
+		vec3 lo = meshes[0]->vertices[0].position, hi = lo;	// bounding sphere of the finest level
+		for (const VertexData& vd : meshes[0]->vertices) {
+			lo = vec3(fminf(lo.x, vd.position.x), fminf(lo.y, vd.position.y), fminf(lo.z, vd.position.z));
+			hi = vec3(fmaxf(hi.x, vd.position.x), fmaxf(hi.y, vd.position.y), fmaxf(hi.z, vd.position.z));
+		}
+		bounds = AABB(lo, hi);
+		center = (lo + hi) * 0.5f;
+		radius = 0;
+		for (const VertexData& vd : meshes[0]->vertices) radius = fmaxf(radius, length(vd.position - center));
+
+		vec3 extent = hi - lo;	// flat surfaces quantize their constant axis to lo
+		if (extent.x == 0) extent.x = 1;
+		if (extent.y == 0) extent.y = 1;
+		if (extent.z == 0) extent.z = 1;
+		bool packed = (format == PackedVertices);
+		size_t stride = packed ? sizeof(PackedVertex) : sizeof(VertexData);
+
+		glState().bindVertexArray(vao);
+		glBindBuffer(GL_ARRAY_BUFFER, vbo);
+		glBufferData(GL_ARRAY_BUFFER, nVertices * stride, nullptr, GL_STATIC_DRAW);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, nIndices * sizeof(unsigned int), nullptr, GL_STATIC_DRAW);
+		std::vector<PackedVertex> packedVertices;
+		for (size_t l = 0; l < lods.size(); l++) {
+			const MeshData& m = *meshes[l];
+			const void* vertices = &m.vertices[0];
+			if (packed) {
+				packedVertices.resize(m.vertices.size());
+				Pack(m, lo, extent, &packedVertices[0]);
+				vertices = &packedVertices[0];
 			}
+			glBufferSubData(GL_ARRAY_BUFFER, lods[l].baseVertex * stride, m.vertices.size() * stride, vertices);
+			glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, lods[l].firstIndex * sizeof(unsigned int), m.indices.size() * sizeof(unsigned int), &m.indices[0]);
 		}
-		glBufferData(GL_ARRAY_BUFFER, nVtxPerStrip * nStrips * sizeof(VertexData), &vtxData[0], GL_STATIC_DRAW);
 		glEnableVertexAttribArray(0);
 		glEnableVertexAttribArray(1);
 		glEnableVertexAttribArray(2);
-		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(VertexData), (void*)offsetof(VertexData, position));
-		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(VertexData), (void*)offsetof(VertexData, normal));
+		if (packed) {
+			glVertexAttribPointer(0, 3, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(PackedVertex), (void*)offsetof(PackedVertex, position));
+			glVertexAttribPointer(1, 4, GL_INT_2_10_10_10_REV, GL_TRUE, sizeof(PackedVertex), (void*)offsetof(PackedVertex, normal));
+			glVertexAttribPointer(2, 2, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(PackedVertex), (void*)offsetof(PackedVertex, uv));
+		} else {
+			glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(VertexData), (void*)offsetof(VertexData, position));
+			glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(VertexData), (void*)offsetof(VertexData, normal));
+			glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(VertexData), (void*)offsetof(VertexData, uv));
+		}
+
+		// the decoding is vertex attribute data of the vao, a divisor no instance count reaches keeps it constant
+		float decode[7] = { 1, 1, 1, 0, 0, 0, 0 };
+		if (packed) {
+			decode[0] = extent.x; decode[1] = extent.y; decode[2] = extent.z; decode[3] = 1;
+			decode[4] = lo.x; decode[5] = lo.y; decode[6] = lo.z;
+		}
+		glBindBuffer(GL_ARRAY_BUFFER, decodeVbo);
+		glBufferData(GL_ARRAY_BUFFER, sizeof(decode), decode, GL_STATIC_DRAW);
+		glEnableVertexAttribArray(decodeAttribute);
+		glEnableVertexAttribArray(decodeAttribute + 1);
+		glVertexAttribPointer(decodeAttribute, 4, GL_FLOAT, GL_FALSE, 0, (void*)0);
+		glVertexAttribPointer(decodeAttribute + 1, 3, GL_FLOAT, GL_FALSE, 0, (void*)(4 * sizeof(float)));
+		glVertexAttribDivisor(decodeAttribute, 0x7FFFFFFF);
+		glVertexAttribDivisor(decodeAttribute + 1, 0x7FFFFFFF);
 	}
 
-	void Draw() {
-		glBindVertexArray(vao);
-		for (unsigned int i = 0; i < nStrips; i++) glDrawArrays(GL_TRIANGLE_STRIP, i * nVtxPerStrip, nVtxPerStrip);
+	int SelectLod(float pixelRadius, int lod) {
+		float required = 2 * (float)M_PI * pixelRadius / lodEdgePixels;	// segments needed along a great circle
+		int last = (int)lods.size() - 1;
+		if (lod > last) lod = last;
+		while (lod > 0 && required > (float)lods[lod].M) lod--;
+		while (lod < last && required < lods[lod + 1].M * (1 - lodHysteresis)) lod++;
+		return lod;
+	}
+
+	void Draw(int lod = 0) {
+		const Lod& level = lods[lod];
+		glState().bindVertexArray(vao);
+		glDrawElementsBaseVertex(GL_TRIANGLES, level.nIndices, GL_UNSIGNED_INT,	// single draw call for the whole surface
+			(void*)(level.firstIndex * sizeof(unsigned int)), level.baseVertex);
+	}
+
+	void DrawInstanced(int lod, int nInstances) {
+		const Lod& level = lods[lod];
+		glState().bindVertexArray(vao);
+		glDrawElementsInstancedBaseVertex(GL_TRIANGLES, level.nIndices, GL_UNSIGNED_INT,
+			(void*)(level.firstIndex * sizeof(unsigned int)), nInstances, level.baseVertex);
+	}
+
+	~ParamSurface() {
+		glDeleteBuffers(1, &ibo);
+		glDeleteBuffers(1, &decodeVbo);
 	}
 };
 
 class Sphere : public ParamSurface {
 public:
-	Sphere() { create(); }
-	void eval(Dnum2& U, Dnum2& V, Dnum2& X, Dnum2& Y, Dnum2& Z) {
+	Sphere(VertexFormat format = PackedVertices) { create(format); }
+	const char* Name() { return "Sphere"; }
+	template<class D> void evalSurface(D& U, D& V, D& X, D& Y, D& Z) {
 		U = U * 2.0f * (float)M_PI, V = V * (float)M_PI;
 		X = Cos(U) * Sin(V); Y = Sin(U) * Sin(V); Z = Cos(V);
 	}
+	void eval(Dnum2& U, Dnum2& V, Dnum2& X, Dnum2& Y, Dnum2& Z) { evalSurface(U, V, X, Y, Z); }
+	void eval(Dnum2x8& U, Dnum2x8& V, Dnum2x8& X, Dnum2x8& Y, Dnum2x8& Z) { evalSurface(U, V, X, Y, Z); }
 };
 
 class Cylinder : public ParamSurface {
 public:
-	Cylinder() { create(); }
-	void eval(Dnum2& U, Dnum2& V, Dnum2& X, Dnum2& Y, Dnum2& Z) {
+	Cylinder(VertexFormat format = PackedVertices) { create(format); }
+	const char* Name() { return "Cylinder"; }
+	template<class D> void evalSurface(D& U, D& V, D& X, D& Y, D& Z) {
 		U = U * 2.0f * M_PI,
 			X = Cos(U); Z = Sin(U); Y = V;
 	}
+	void eval(Dnum2& U, Dnum2& V, Dnum2& X, Dnum2& Y, Dnum2& Z) { evalSurface(U, V, X, Y, Z); }
+	void eval(Dnum2x8& U, Dnum2x8& V, Dnum2x8& X, Dnum2x8& Y, Dnum2x8& Z) { evalSurface(U, V, X, Y, Z); }
 };
 
 class Circle : public ParamSurface {
 public:
-	Circle() { create(); }
-	void eval(Dnum2& U, Dnum2& V, Dnum2& X, Dnum2& Y, Dnum2& Z) {
+	Circle(VertexFormat format = PackedVertices) { create(format); }
+	const char* Name() { return "Circle"; }
+	template<class D> void evalSurface(D& U, D& V, D& X, D& Y, D& Z) {
 		U = U * 2.0f * (float)M_PI, V = V * (float)M_PI;
 		X = Cos(U) * Sin(V); Y = 0; Z = Sin(U) * Sin(V);
 	}
+	void eval(Dnum2& U, Dnum2& V, Dnum2& X, Dnum2& Y, Dnum2& Z) { evalSurface(U, V, X, Y, Z); }
+	void eval(Dnum2x8& U, Dnum2x8& V, Dnum2x8& X, Dnum2x8& Y, Dnum2x8& Z) { evalSurface(U, V, X, Y, Z); }
 };
 
 class Paraboloid : public ParamSurface {
 public:
-	Paraboloid() { create(); }
-	void eval(Dnum2& U, Dnum2& V, Dnum2& X, Dnum2& Y, Dnum2& Z) {
+	Paraboloid(VertexFormat format = PackedVertices) { create(format); }
+	const char* Name() { return "Paraboloid"; }
+	template<class D> void evalSurface(D& U, D& V, D& X, D& Y, D& Z) {
 		V = V * (float)M_PI, U = U * 2.0f * (float)M_PI;
 		X = V * Cos(U); Y = V * V; Z = V * Sin(U);
 	}
+	void eval(Dnum2& U, Dnum2& V, Dnum2& X, Dnum2& Y, Dnum2& Z) { evalSurface(U, V, X, Y, Z); }
+	void eval(Dnum2x8& U, Dnum2x8& V, Dnum2x8& X, Dnum2x8& Y, Dnum2x8& Z) { evalSurface(U, V, X, Y, Z); }
 };
 
-struct Object {
-	int id;
+// Objects of the scene as a structure of arrays, an object is an index into them. Shaders, materials and geometries
+// live in the arena of the scene, the objects refer to them by their index in its tables.
+struct ObjectStore {
+	std::vector<int> shaders, materials, geometries;
+	std::vector<int> nodes;	// placement in the scene graph
+	std::vector<int> lods;	// detail level of the last frame
+
+	int Add(int shader, int material, int geometry, int node) {
+		shaders.push_back(shader);
+		materials.push_back(material);
+		geometries.push_back(geometry);
+		nodes.push_back(node);
+		lods.push_back(0);
+		return (int)nodes.size() - 1;
+	}
+
+	int size() const { return (int)nodes.size(); }
+};
+
+inline float ViewDepth(const Geometry& geometry, const RenderState& state) {	// of the bounding sphere center, state.M has to be set
+	return -(vec4(geometry.center.x, geometry.center.y, geometry.center.z, 1) * state.M * state.V).z;
+}
+
+inline float PixelRadius(const Geometry& geometry, const RenderState& state) {	// projected radius of the bounding sphere in pixels
+	float scale = 0;	// the longest axis of the modeling transformation
+	for (int i = 0; i < 3; i++) scale = fmaxf(scale, length(vec3(state.M[i][0], state.M[i][1], state.M[i][2])));
+	float r = geometry.radius * scale;
+	float depth = ViewDepth(geometry, state);
+	if (depth <= r) return (float)windowHeight;	// the camera is inside or close to the sphere
+	return r * state.P[1][1] / depth * windowHeight / 2;
+}
+
+struct Swing {	// joint angle going back and forth, the same number of steps in both directions
+	float angle, speed;
+	int steps, counter;
+	bool forward;
+
+	Swing(float _speed, int _steps) : angle(0), speed(_speed), steps(_steps), counter(0), forward(true) { }
+
+	float Step(float dt) {
+		angle += forward ? speed * dt : -speed * dt;
+		if (++counter == steps) { forward = !forward; counter = 0; }
+		return angle;
+	}
+};
+
+struct DrawItem {
+	unsigned long long key;
 	Shader* shader;
 	Material* material;
 	Geometry* geometry;
-	vec3 scale, translation, rotationAxis;
-	float rotationAngle;
-	vec3 top, rotation;
+	int lod;
+	const mat4* M;
+	unsigned int condition;	// occlusion query the draw is conditional on, 0 for none
+
+	bool SameBatch(const DrawItem& item) const {	// differs only in the transformation
+		return shader == item.shader && material == item.material && geometry == item.geometry && lod == item.lod;
+	}
+};
+
+// Draw items of a frame, sorted by a packed key of program, material, geometry, lod and depth, from the most expensive
+// state change to the cheapest. Objects sharing all states end up next to each other, nearest first for early depth
+// rejection. The ids are masked to their fields, a collision only costs a state change.
+class RenderQueue {
+	std::vector<DrawItem> items;	// the allocation is kept from frame to frame
 public:
-	Object(Shader* _shader, Material* _material, Geometry* _geometry, int _id) :
-		scale(vec3(1, 1, 1)), translation(vec3(0, 0, 0)), rotationAxis(0, 0, 1), rotationAngle(0) {
-		shader = _shader;
-		material = _material;
-		geometry = _geometry;
-		id = _id;
-		if (id == 3)top = vec3(0, 2, 0);
-		else if (id == 5) { top = vec3(0, 4.2, 0); rotation = vec3(0, 2, 0);}
-		else if (id == 7) { top = vec3(0, 4.0, 0); rotation = vec3(0, 0.5, 0);}	
+	static const int depthBits = 26, lodBits = 4, geometryBits = 12, materialBits = 12, shaderBits = 10;
+
+	void Clear() { items.clear(); }
+
+	// M has to stay valid until the queue is drawn, depth is 0 at the near and 1 at the far plane
+	void Add(Shader* shader, Material* material, Geometry* geometry, int lod, const mat4& M, float depth, unsigned int condition = 0) {
+		unsigned long long field = 0, key = 0;
+		field = (unsigned long long)(shader->sortId & ((1 << shaderBits) - 1));
+		key = field;
+		field = (unsigned long long)(material->sortId & ((1 << materialBits) - 1));
+		key = (key << materialBits) | field;
+		field = (unsigned long long)(geometry->sortId & ((1 << geometryBits) - 1));
+		key = (key << geometryBits) | field;
+		key = (key << lodBits) | (unsigned long long)(lod & ((1 << lodBits) - 1));
+		depth = (depth < 0) ? 0 : ((depth > 1) ? 1 : depth);
+		key = (key << depthBits) | (unsigned long long)(depth * ((1 << depthBits) - 1));
+		items.push_back(DrawItem{ key, shader, material, geometry, lod, &M, condition });
 	}
 
-	void Draw(RenderState state) {
-		mat4 M = ScaleMatrix(scale) * RotationMatrix(rotationAngle, rotationAxis) * TranslateMatrix(translation);
-		mat4 Minv = TranslateMatrix(-translation) * RotationMatrix(-rotationAngle, rotationAxis) * ScaleMatrix(vec3(1 / scale.x, 1 / scale.y, 1 / scale.z));
-		state.M = M;
-		state.Minv = Minv;
-		state.MVP = state.M * state.V * state.P;
-		state.material = material;
-		shader->Bind(state);
-		geometry->Draw();
+	void Sort() { std::sort(items.begin(), items.end(), [](const DrawItem& a, const DrawItem& b) { return a.key < b.key; }); }
+
+	const std::vector<DrawItem>& Items() const { return items; }
+};
+
+// Occlusion culling with the results of the previous frame, so nothing waits for the GPU. Objects appearing from
+// behind an occluder show up one frame late.
+//  Queries: the world boxes of the objects in the frustum are drawn against the depth buffer at the end of the frame
+//  in GL_ANY_SAMPLES_PASSED queries. In the next frame an object whose query is known to be zero is skipped, the others
+//  are drawn under conditional rendering with GL_QUERY_NO_WAIT, which draws if the result is not there yet.
+//  HiZ: for software GL, where reading the depth buffer is only a copy. The depth buffer is read into a PBO at the end
+//  of the frame, and in the next frame reduced to a pyramid of maximum depths on the CPU. A box is hidden if its nearest
+//  point is behind the farthest depth of the pyramid texels covering it, with the view of the captured frame.
+class OcclusionCuller {
+public:
+	enum Mode { Off, Queries, HiZ };
+private:
+	Mode mode = Off;
+	int frame = 0;
+	std::vector<unsigned int> queries[2];	// per object, used in even and odd frames
+	std::vector<char> issued[2];			// the query of the object was drawn in the frame
+	GPUProgram boxProgram{ false };
+	unsigned int boxVao = 0, boxVbo = 0, boxIbo = 0;
+	int vpLocation = -1, loLocation = -1, hiLocation = -1;
+
+	unsigned int pbos[2] = { 0, 0 };		// depth of the even and odd frames
+	bool captured[2] = { false, false };
+	mat4 capturedVP[2];
+	std::vector<std::vector<float>> levels;	// maximum depth pyramid, level 0 has the resolution of the window
+	std::vector<int> widths, heights;
+	mat4 hizVP;								// view of the pyramid
+	bool hizValid = false;
+
+	void CreateBoxes() {
+		const char* vertexSource = R"(
+			#version 330
+			precision highp float;
+			uniform mat4 VP;
+			uniform vec3 lo, hi;	// world box
+			layout(location = 0) in vec3 corner;	// of the unit cube
+			void main() { gl_Position = vec4(mix(lo, hi, corner), 1) * VP; }
+		)";
+		const char* fragmentSource = R"(
+			#version 330
+			precision highp float;
+			out vec4 fragmentColor;
+			void main() { fragmentColor = vec4(1, 1, 1, 1); }
+		)";
+		boxProgram.create(vertexSource, fragmentSource, "fragmentColor");
+		vpLocation = boxProgram.getLocation("VP");
+		loLocation = boxProgram.getLocation("lo");
+		hiLocation = boxProgram.getLocation("hi");
+		float corners[8][3];
+		for (int c = 0; c < 8; c++) { corners[c][0] = (float)(c & 1); corners[c][1] = (float)(c >> 1 & 1); corners[c][2] = (float)(c >> 2 & 1); }
+		unsigned int faces[36] = { 0, 2, 1, 1, 2, 3,  4, 5, 6, 5, 7, 6,  0, 1, 4, 1, 5, 4,  2, 6, 3, 3, 6, 7,  0, 4, 2, 2, 4, 6,  1, 3, 5, 3, 7, 5 };
+		glGenVertexArrays(1, &boxVao);
+		glState().bindVertexArray(boxVao);
+		glGenBuffers(1, &boxVbo);
+		glBindBuffer(GL_ARRAY_BUFFER, boxVbo);
+		glBufferData(GL_ARRAY_BUFFER, sizeof(corners), corners, GL_STATIC_DRAW);
+		glEnableVertexAttribArray(0);
+		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, nullptr);
+		glGenBuffers(1, &boxIbo);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, boxIbo);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(faces), faces, GL_STATIC_DRAW);
 	}
 
-	virtual void Animate(float dt) {
-		if (id == 3) {
+	void BuildPyramid(int slot) {	// from the depth captured in the slot
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos[slot]);
+		const float* depth = (const float*)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, windowWidth * windowHeight * sizeof(float), GL_MAP_READ_BIT);
+		if (depth) {
+			widths.assign(1, windowWidth);
+			heights.assign(1, windowHeight);
+			levels.resize(1);
+			levels[0].assign(depth, depth + windowWidth * windowHeight);
+			while (widths.back() > 1 || heights.back() > 1) {	// 2x2 maximum, the odd last row and column are kept
+				int w = widths.back(), h = heights.back(), nw = (w + 1) / 2, nh = (h + 1) / 2;
+				std::vector<float> next(nw * nh);
+				const std::vector<float>& prev = levels.back();
+				threadPool().parallelFor(0, nh, [&](int y) {
+					for (int x = 0; x < nw; x++) {
+						int x1 = (2 * x + 1 < w) ? 2 * x + 1 : 2 * x, y1 = (2 * y + 1 < h) ? 2 * y + 1 : 2 * y;
+						next[y * nw + x] = fmaxf(fmaxf(prev[2 * y * w + 2 * x], prev[2 * y * w + x1]), fmaxf(prev[y1 * w + 2 * x], prev[y1 * w + x1]));
+					}
+				}, 16);
+				levels.push_back(std::move(next));
+				widths.push_back(nw);
+				heights.push_back(nh);
+			}
+			hizVP = capturedVP[slot];
+			hizValid = true;
+		}
+		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	}
 
-			rotationAxis = vec3(0, 0, 1);
-			rotationAngle = rotationAngle + dt;
-			vec3 newTop = vec3(top.x * cosf(dt) - top.y * sinf(dt),
-				top.x * sinf(dt) + top.y * cosf(dt),
-				top.z);
-			top = newTop;
+	bool HiddenInPyramid(const AABB& box) const {
+		float x0 = 1e30f, y0 = 1e30f, x1 = -1e30f, y1 = -1e30f, zNear = 1e30f;
+		for (int c = 0; c < 8; c++) {
+			vec4 p = vec4((c & 1) ? box.hi.x : box.lo.x, (c & 2) ? box.hi.y : box.lo.y, (c & 4) ? box.hi.z : box.lo.z, 1) * hizVP;
+			if (p.w <= 0 || p.z < -p.w) return false;	// reaches the near plane
+			x0 = fminf(x0, p.x / p.w); x1 = fmaxf(x1, p.x / p.w);
+			y0 = fminf(y0, p.y / p.w); y1 = fmaxf(y1, p.y / p.w);
+			zNear = fminf(zNear, p.z / p.w * 0.5f + 0.5f);
 		}
-		if (id == 5) {
+		int width = (int)windowWidth, height = (int)windowHeight;
+		int px0 = (int)floorf((x0 * 0.5f + 0.5f) * width), px1 = (int)floorf((x1 * 0.5f + 0.5f) * width);
+		int py0 = (int)floorf((y0 * 0.5f + 0.5f) * height), py1 = (int)floorf((y1 * 0.5f + 0.5f) * height);
+		if (px1 < 0 || py1 < 0 || px0 >= width || py0 >= height) return false;	// left the captured view
+		px0 = (px0 < 0) ? 0 : px0; py0 = (py0 < 0) ? 0 : py0;
+		px1 = (px1 >= width) ? width - 1 : px1; py1 = (py1 >= height) ? height - 1 : py1;
+		int level = 0;	// where the rectangle covers at most 2x2 texels
+		while (level + 1 < (int)levels.size() && ((px1 >> level) - (px0 >> level) > 1 || (py1 >> level) - (py0 >> level) > 1)) level++;
+		for (int y = py0 >> level; y <= py1 >> level; y++)
+			for (int x = px0 >> level; x <= px1 >> level; x++)
+				if (zNear <= levels[level][y * widths[level] + x]) return false;
+		return true;
+	}
 
-			rotationAxis = vec3(1, 0, 0);
-			rotationAngle = rotationAngle + dt;
-			top = vec3(translation.x, translation.y - 0.15f, translation.z);
+public:
+	Mode GetMode() const { return mode; }
 
-			rotation = vec3(0,
-				rotation.y * cosf(dt) - rotation.z * sinf(dt),
-				rotation.y * sinf(dt) + rotation.z * cosf(dt));
-			top = top + rotation;
+	void SetMode(Mode _mode) {	// old results do not carry over
+		mode = _mode;
+		for (int slot = 0; slot < 2; slot++) {
+			std::fill(issued[slot].begin(), issued[slot].end(), 0);
+			captured[slot] = false;
+		}
+		hizValid = false;
+	}
+
+	void BeginFrame(int nObjects) {
+		frame++;
+		for (int slot = 0; slot < 2; slot++) {
+			while ((int)queries[slot].size() < nObjects && mode == Queries) {
+				unsigned int query;
+				glGenQueries(1, &query);
+				queries[slot].push_back(query);
+			}
+			issued[slot].resize(queries[slot].size(), 0);
 		}
-		if (id == 7) {
+		int previous = (frame - 1) & 1;
+		if (mode == HiZ && captured[previous]) BuildPyramid(previous);
+	}
 
-			rotationAxis = vec3(1, 0, 0);
-			rotationAngle = rotationAngle + dt;
+	bool Hidden(int object, const AABB& box) {	// by the results of the previous frame, does not wait
+		if (mode == HiZ) return hizValid && HiddenInPyramid(box);
+		int previous = (frame - 1) & 1;
+		if (mode != Queries || object >= (int)issued[previous].size() || !issued[previous][object]) return false;
+		unsigned int available = 0, samples = 1;
+		glGetQueryObjectuiv(queries[previous][object], GL_QUERY_RESULT_AVAILABLE, &available);
+		if (available) glGetQueryObjectuiv(queries[previous][object], GL_QUERY_RESULT, &samples);
+		return available && samples == 0;
+	}
 
-			top = vec3(translation.x, translation.y + 0.15f, translation.z);
+	unsigned int Condition(int object) const {	// query of the previous frame to draw the object under, 0 for none
+		int previous = (frame - 1) & 1;
+		if (mode != Queries || object >= (int)issued[previous].size() || !issued[previous][object]) return 0;
+		return queries[previous][object];
+	}
 
-			rotation = vec3(0,
-				rotation.y * cosf(dt) - rotation.z * sinf(dt),
-				rotation.y * sinf(dt) + rotation.z * cosf(dt));
-			top = top + rotation;
+	// after the frame is drawn: the objects in the frustum are tested for the next frame
+	void EndFrame(const std::vector<int>& inFrustum, const BVH& bvh, const mat4& VP, const vec3& wEye, float nearDistance) {
+		int current = frame & 1;
+		if (mode == Queries) {
+			if (boxVao == 0) CreateBoxes();
+			std::fill(issued[current].begin(), issued[current].end(), 0);
+			GLboolean depthMask;
+			glGetBooleanv(GL_DEPTH_WRITEMASK, &depthMask);
+			glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+			glDepthMask(GL_FALSE);
+			boxProgram.Use();
+			boxProgram.setUniform(VP, vpLocation);
+			glState().bindVertexArray(boxVao);
+			float margin = nearDistance * 2;	// the near plane cuts boxes around the eye, they are not queried
+			for (int object : inFrustum) {
+				const AABB& box = bvh.Box(object);
+				if (wEye.x > box.lo.x - margin && wEye.x < box.hi.x + margin && wEye.y > box.lo.y - margin && wEye.y < box.hi.y + margin &&
+					wEye.z > box.lo.z - margin && wEye.z < box.hi.z + margin) continue;
+				boxProgram.setUniform(box.lo, loLocation);
+				boxProgram.setUniform(box.hi, hiLocation);
+				glBeginQuery(GL_ANY_SAMPLES_PASSED, queries[current][object]);
+				glDrawElements(GL_TRIANGLES, 36, GL_UNSIGNED_INT, nullptr);
+				glEndQuery(GL_ANY_SAMPLES_PASSED);
+				issued[current][object] = 1;
+			}
+			glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+			glDepthMask(depthMask);
+		}
+		if (mode == HiZ) {
+			if (pbos[current] == 0) {
+				glGenBuffers(2, pbos);
+				for (int slot = 0; slot < 2; slot++) {
+					glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos[slot]);
+					glBufferData(GL_PIXEL_PACK_BUFFER, windowWidth * windowHeight * sizeof(float), nullptr, GL_STREAM_READ);
+				}
+			}
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos[current]);
+			glReadPixels(0, 0, windowWidth, windowHeight, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);	// finishes later, in the PBO
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+			captured[current] = true;
+			capturedVP[current] = VP;
 		}
 	}
+
+	void Release() {	// while the context is current
+		for (int slot = 0; slot < 2; slot++) {
+			if (!queries[slot].empty()) glDeleteQueries((int)queries[slot].size(), queries[slot].data());
+			queries[slot].clear();
+			issued[slot].clear();
+			captured[slot] = false;
+		}
+		boxProgram.release();
+		if (pbos[0] > 0) glDeleteBuffers(2, pbos);
+		pbos[0] = pbos[1] = 0;
+		if (boxVao > 0) {
+			glDeleteBuffers(1, &boxVbo);
+			glDeleteBuffers(1, &boxIbo);
+			glDeleteVertexArrays(1, &boxVao);
+			glState().invalidate();
+		}
+		boxVao = boxVbo = boxIbo = 0;
+	}
+
+	~OcclusionCuller() { Release(); }
 };
 
 class Scene {
-	std::vector<Object*> objects;
+	Arena arena;	// shaders, materials and geometries, released by Release while the context is current
+	std::vector<Shader*> shaders;
+	std::vector<Material*> materials;
+	std::vector<Geometry*> geometries;
+	ObjectStore objects;
 	Camera camera;
 	std::vector<Light> lights;
-	int counter0 = 0; int counter1 = 0; int counter2 = 0;
-	bool flag = true; bool flag1 = true; bool flag2 = true;
+	std::vector<Light> lamps;	// static point lights on the floor, shown with showLamps
+	std::vector<Light> frameLights;
+
+	RenderQueue queue;
+	BVH bvh;	// world boxes of the objects for frustum culling
+	std::vector<int> inFrustum;	// objects of the frame in the frustum, visible or occluded
+	std::vector<InstanceData> instances;	// of one instanced draw
+	SceneGraph graph;		// simulated, written by Animate
+	SceneGraph renderGraph;	// the same hierarchy with the interpolated transformations of the rendered frame
+	int arm1, arm2, head, bulb;	// animated nodes of the lamp
+	Swing swing1 = Swing(1, 100), swing2 = Swing(1, 200), swing3 = Swing(3, 100);
+	template<class T, class U> static int Register(std::vector<T*>& table, U* item) {	// index of the item in the table
+		table.push_back(item);
+		return (int)table.size() - 1;
+	}
 public:
+	bool instancing = true;
+	bool showLamps = false;
+	LightGrid lightGrid;
+	OcclusionCuller occlusion;
+
+	void Release() {	// GL objects of the scene, at exit, the static destructors run without a context
+		objects = ObjectStore();
+		shaders.clear();
+		materials.clear();
+		geometries.clear();
+		arena.release();
+		lightGrid.Release();
+		occlusion.Release();
+	}
+
 	void Build() {
-		Shader* phongShader = new PhongShader();
-
-		Material* material0 = new Material;
-		material0->kd = vec3(0.1f, 0.1f, 0.4f);
-		material0->ks = vec3(0.5f, 0.5f, 0.5f);
-		material0->ka = vec3(0.1f, 0.1f, 0.4f);
-		material0->shininess = 50;
-
-		Material* material1 = new Material;
-		material1->kd = vec3(0.4f, 0.2f, 0.05f);
-		material1->ks = vec3(0.2, 0.2, 0.2);
-		material1->ka = vec3(0.4f, 0.2f, 0.05f);
-		material1->shininess = 30;
-
-		Material* material2 = new Material;
-		material2->kd = vec3(0.9f, 0.9f, 0.9f);
-		material2->ks = vec3(10.2, 10.2, 10.2);
-		material2->ka = vec3(0.9f, 0.9f, 0.9f);
-		material2->shininess = 1;
-
-		Geometry* sphere = new Sphere();
-		Geometry* cylinder = new Cylinder();
-		Geometry* circle = new Circle();
-		Geometry* paraboloid = new Paraboloid();
-
-		Object* floor0 = new Object(phongShader, material1, circle, 8);
-		floor0->translation = vec3(0, 0, 0);
-		floor0->scale = vec3(30, 30, 30);
-		objects.push_back(floor0);
-
-		Object* cylinder1 = new Object(phongShader, material0, cylinder, 0);
-		cylinder1->translation = vec3(0, 0, 0);
-		cylinder1->scale = vec3(1, 0.167, 1);
-		objects.push_back(cylinder1);
-
-		Object* sphere1 = new Object(phongShader, material0, sphere, 1);
-		sphere1->translation = vec3(0, 0.17, 0);
-		sphere1->scale = vec3(0.2f, 0.2f, 0.2f);
-		objects.push_back(sphere1);
-
-		Object* circle1 = new Object(phongShader, material0, circle, 2);
-		circle1->translation = vec3(0, 0.165, 0);
-		objects.push_back(circle1);
-
-		Object* cylinder2 = new Object(phongShader, material0, cylinder, 3);
-		cylinder2->translation = vec3(0, 0.17, 0);
-		cylinder2->scale = vec3(0.1f, 2.0f, 0.1f);
-		objects.push_back(cylinder2);
-
-		Object* sphere2 = new Object(phongShader, material0, sphere, 4);
-		sphere2->translation = vec3(0, 2.2, 0);
-		sphere2->scale = vec3(0.2f, 0.2f, 0.2f);
-		objects.push_back(sphere2);
-
-		Object* cylinder3 = new Object(phongShader, material0, cylinder, 5);
-		cylinder3->translation = vec3(0, 2.2, 0);
-		cylinder3->scale = vec3(0.1f, 2.0f, 0.1f);
-		objects.push_back(cylinder3);
-
-		Object* sphere3 = new Object(phongShader, material0, sphere, 6);
-		sphere3->translation = vec3(0, 4.2, 0);
-		sphere3->scale = vec3(0.2f, 0.2f, 0.2f);
-		objects.push_back(sphere3);
-
-		Object* paraboloid1 = new Object(phongShader, material0, paraboloid, 7);
-		paraboloid1->translation = vec3(0, 4, 0);
-		paraboloid1->scale = vec3(0.3, 0.15, 0.3);
-		objects.push_back(paraboloid1);
-
-		Object* bulb = new Object(phongShader, material2, sphere, 8);
-		bulb->translation = vec3(0, 4.4, 0);
-		bulb->scale = vec3(0.3f, 0.3f, 0.3f);
-		objects.push_back(bulb);
+		PhongShader* phongShader = arena.make<PhongShader>();
+		int phong = Register(shaders, phongShader);
+
+		int material0 = Register(materials, arena.make<Material>());
+		materials[material0]->kd = vec3(0.1f, 0.1f, 0.4f);
+		materials[material0]->ks = vec3(0.5f, 0.5f, 0.5f);
+		materials[material0]->ka = vec3(0.1f, 0.1f, 0.4f);
+		materials[material0]->shininess = 50;
+
+		int material1 = Register(materials, arena.make<Material>());
+		materials[material1]->kd = vec3(0.4f, 0.2f, 0.05f);
+		materials[material1]->ks = vec3(0.2, 0.2, 0.2);
+		materials[material1]->ka = vec3(0.4f, 0.2f, 0.05f);
+		materials[material1]->shininess = 30;
+
+		int material2 = Register(materials, arena.make<Material>());
+		materials[material2]->kd = vec3(0.9f, 0.9f, 0.9f);
+		materials[material2]->ks = vec3(10.2, 10.2, 10.2);
+		materials[material2]->ka = vec3(0.9f, 0.9f, 0.9f);
+		materials[material2]->shininess = 1;
+
+		int sphere = Register(geometries, arena.make<Sphere>());
+		int cylinder = Register(geometries, arena.make<Cylinder>());
+		int circle = Register(geometries, arena.make<Circle>());
+		int paraboloid = Register(geometries, arena.make<Paraboloid>());
+
+		objects.Add(phong, material1, circle, graph.AddNode(-1, Transform(vec3(30, 30, 30))));
+
+		int base = graph.AddNode(-1);
+		objects.Add(phong, material0, cylinder, graph.AddNode(base, Transform(vec3(1, 0.167f, 1))));
+		objects.Add(phong, material0, sphere, graph.AddNode(base, Transform(vec3(0.2f, 0.2f, 0.2f), vec3(0, 0.17f, 0))));
+		objects.Add(phong, material0, circle, graph.AddNode(base, Transform(vec3(1, 1, 1), vec3(0, 0.165f, 0))));
+
+		arm1 = graph.AddNode(base, Transform(vec3(1, 1, 1), vec3(0, 0.17f, 0), vec3(0, 0, 1)));	// joint on the base
+		objects.Add(phong, material0, cylinder, graph.AddNode(arm1, Transform(vec3(0.1f, 2, 0.1f))));
+
+		arm2 = graph.AddNode(arm1, Transform(vec3(1, 1, 1), vec3(0, 2, 0), vec3(1, 0, 0)));	// elbow at the top of the first arm
+		objects.Add(phong, material0, sphere, graph.AddNode(arm2, Transform(vec3(0.2f, 0.2f, 0.2f))));
+		objects.Add(phong, material0, cylinder, graph.AddNode(arm2, Transform(vec3(0.1f, 2, 0.1f))));
+
+		head = graph.AddNode(arm2, Transform(vec3(1, 1, 1), vec3(0, 2, 0), vec3(1, 0, 0)));	// wrist at the top of the second arm
+		objects.Add(phong, material0, sphere, graph.AddNode(head, Transform(vec3(0.2f, 0.2f, 0.2f))));
+		objects.Add(phong, material0, paraboloid, graph.AddNode(head, Transform(vec3(0.3f, 0.15f, 0.3f))));
+
+		bulb = graph.AddNode(head, Transform(vec3(0.3f, 0.3f, 0.3f), vec3(0, 0.65f, 0)));
+		objects.Add(phong, material2, sphere, bulb);
+		graph.Update();
+		renderGraph = graph;
 
 		camera.wEye = vec3(0, 10, 6);
 		camera.wLookat = vec3(0, 2, 0);
@@ -478,117 +1707,254 @@ public:
 		lights[1].La = vec3(0.0f, 0.0f, 0.0f);
 		lights[1].Le = vec3(2.9, 2.9, 2.9);
 		lights[1].direction = vec4(0, 5, 0, 1);
+		lights[1].cosCone = cosf((float)M_PI / 3);	// 60 degree half angle
+		phongShader->Prepare(LightLayout(lights, lightGrid.clustered));
+
+		const int lampGrid = 16;	// a lampGrid x lampGrid field of small colored lamps on the floor
+		for (int i = 0; i < lampGrid * lampGrid; i++) {
+			Light lamp;
+			float x = (i % lampGrid - (lampGrid - 1) / 2.0f) * 1.2f, z = (i / lampGrid - (lampGrid - 1) / 2.0f) * 1.2f;
+			lamp.wLightPos = vec4(x, 0.3f, z, 1);
+			lamp.La = vec3(0, 0, 0);
+			lamp.Le = vec3(0.3f + 0.7f * (i % 3 == 0), 0.3f + 0.7f * (i % 3 == 1), 0.3f + 0.7f * (i % 3 == 2));
+			lamp.direction = vec4(0, 0, 0, 1);
+			lamp.range = 1.5f;
+			lamps.push_back(lamp);
+		}
 	}
 
-	void Render() {
-		RenderState state;
-		state.wEye = camera.wEye;
-		state.V = camera.V();
-		state.P = camera.P();
-		state.lights = lights;
-		for (Object* obj : objects) obj->Draw(state);
+	void Capture(Snapshot& snapshot) {	// simulation side, the state after the last Animate
+		snapshot.transforms = graph.Locals();
+		snapshot.lights = lights;
+		snapshot.camera = camera;
 	}
 
+	void Render(const Snapshot& snapshot) {	// reads only the snapshot of the simulated state
+		ProfileScope scope("Render");
+		Camera view = snapshot.camera;
+		RenderState state;
+		state.wEye = view.wEye;
+		state.V = view.V();
+		state.P = view.P();
+		frameLights = snapshot.lights;
+		if (showLamps) frameLights.insert(frameLights.end(), lamps.begin(), lamps.end());
+		lightGrid.Update(frameLights, view);
+		lightGrid.Bind();
+		state.lightLayout = &lightGrid.Layout();
+		for (int i = 0; i < renderGraph.size(); i++) renderGraph.SetLocal(i, snapshot.transforms[i]);
+		renderGraph.Update();
+
+		const int* nodes = objects.nodes.data();
+		const int* objectGeometries = objects.geometries.data();
+		if (bvh.size() != objects.size()) {	// world boxes of all the objects at the first frame
+			std::vector<AABB> boxes(objects.size());
+			for (int i = 0; i < objects.size(); i++) boxes[i] = geometries[objectGeometries[i]]->bounds.Transformed(renderGraph.World(nodes[i]));
+			bvh.Build(boxes);
+		}
+		else {	// only the moved objects
+			for (int i = 0; i < objects.size(); i++)
+				if (renderGraph.Changed(nodes[i])) bvh.Update(i, geometries[objectGeometries[i]]->bounds.Transformed(renderGraph.World(nodes[i])));
+			bvh.Refit();
+		}
 
-
-	void Animate(float dt) {
-		vec3 cTop1, cTop2, focus; vec3 dir;
-		for (Object* obj : objects) {
-			if (obj->id == 3 && flag) {
-				if (counter0 == 100) { flag = false; counter0 = 0; }
-				obj->Animate(dt);
-				cTop1 = obj->top;
-				counter0++;
-			}
-
-			if (obj->id == 3 && !flag) {
-				if (counter0 == 100) { flag = true; counter0 = 0; }
-				obj->Animate(-dt);
-				cTop1 = obj->top;
-				counter0++;
-			}
-			if (obj->id == 4) {
-				vec3 correct = cTop1;
-				correct.y += 0.15f;
-				obj->translation = correct;
-			}
-			if (obj->id == 5 && flag1) {
-				vec3 correct = cTop1;
-				correct.y += 0.15f;
-				obj->translation = correct;
-
-				if (counter1 == 200) { flag1 = false; counter1 = 0; }
-				obj->Animate(dt);
-
-				cTop2 = obj->top;
-				counter1++;
+		occlusion.BeginFrame(objects.size());
+		inFrustum.clear();
+		queue.Clear();
+		bvh.Query(Frustum(state.V * state.P), [&](int i) {
+			inFrustum.push_back(i);
+			if (occlusion.Hidden(i, bvh.Box(i))) return;
+			Geometry* geometry = geometries[objectGeometries[i]];
+			state.M = renderGraph.World(nodes[i]);
+			int lod = objects.lods[i] = geometry->SelectLod(PixelRadius(*geometry, state), objects.lods[i]);
+			queue.Add(shaders[objects.shaders[i]], materials[objects.materials[i]], geometry, lod, renderGraph.World(nodes[i]),
+				(ViewDepth(*geometry, state) - view.fp) / (view.bp - view.fp), occlusion.Condition(i));
+		});
+		queue.Sort();
+
+		// walk the runs of items sharing all states, the states are only set when they change
+		const std::vector<DrawItem>& items = queue.Items();
+		Shader* shader = nullptr;
+		Material* material = nullptr;
+		for (size_t first = 0, last; first < items.size(); first = last) {
+			for (last = first + 1; last < items.size() && items[last].SameBatch(items[first]); last++);
+			const DrawItem& item = items[first];
+			if (item.shader != shader) {
+				shader = item.shader;
+				if (instancing) shader->BindInstanced(state);
+				else shader->Bind(state);
 			}
-			if (obj->id == 5 && !flag1) {
-				vec3 correct = cTop1;
-				correct.y += 0.15f;
-				obj->translation = correct;
-
-				if (counter1 == 200) { flag1 = true; counter1 = 0; }
-				obj->Animate(-dt);
-				cTop2 = obj->top;
-				counter1++;
+			if (item.material != material) {
+				material = item.material;
+				material->Bind();
 			}
-			if (obj->id == 6) {
-				vec3 correct1 = cTop2;
-				correct1.y += 0.15f;
-				obj->translation = correct1;
+			if (instancing) {
+				ProfileScope drawScope("Draw");
+				instances.clear();
+				for (size_t i = first; i < last; i++) {
+					InstanceData instance;
+					instance.M = *items[i].M;
+					instance.Normal = NormalMatrix(instance.M);
+					instances.push_back(instance);
+				}
+				item.geometry->SetInstances(instances);
+				item.geometry->DrawInstanced(item.lod, (int)instances.size());
 			}
-			if (obj->id == 7 && flag2) {
-				vec3 correct2 = cTop2;
-				correct2.y += 0.15f;
-				obj->translation = correct2;
-
-				if (counter2 == 100) { flag2 = false; counter2 = 0; }
-				obj->Animate(dt * 3);
-				focus = obj->top;
-				counter2++;
-			}
-			if (obj->id == 7 && !flag2) {
-				vec3 correct2 = cTop2;
-				correct2.y += 0.15f;
-				obj->translation = correct2;
-
-				if (counter2 == 100) { flag2 = true; counter2 = 0; }
-				obj->Animate(-dt * 3);
-				focus = obj->top;
-				counter2++;
-			}
-			if (obj->id == 8) {
-				vec3 correct2 = focus;
-				//correct2.y += 0.15f;
-				obj->translation = correct2;
+			else {
+				for (size_t i = first; i < last; i++) {
+					ProfileScope drawScope("Draw");
+					state.M = *items[i].M;
+					state.Normal = NormalMatrix(state.M);
+					state.MVP = state.M * state.V * state.P;
+					shader->SetTransform(state);
+					if (items[i].condition) glBeginConditionalRender(items[i].condition, GL_QUERY_NO_WAIT);
+					item.geometry->Draw(item.lod);
+					if (items[i].condition) glEndConditionalRender();
+				}
 			}
 		}
+
+		if (occlusion.GetMode() != OcclusionCuller::Off) {
+			ProfileScope occlusionScope("Occlusion");
+			occlusion.EndFrame(inFrustum, bvh, state.V * state.P, view.wEye, view.fp);
+		}
+	}
+
+	void Animate(float dt) {
+		ProfileScope scope("Animate", false);	// CPU only, may run on the simulation thread
+		Transform joint = graph.Local(arm1);
+		joint.rotationAngle = swing1.Step(dt);
+		graph.SetLocal(arm1, joint);
+		joint = graph.Local(arm2);
+		joint.rotationAngle = swing2.Step(dt);
+		graph.SetLocal(arm2, joint);
+		joint = graph.Local(head);
+		joint.rotationAngle = swing3.Step(dt);
+		graph.SetLocal(head, joint);
+		graph.Update();
+
+		vec3 focus = graph.Position(bulb);
+		vec3 cTop2 = graph.Position(head) - vec3(0, 0.15f, 0);
+		vec3 dir = focus - cTop2 / 1.5;
 		camera.Animate(dt);
 
 		lights[1].wLightPos = vec4(focus.x, focus.y, focus.z, 1);
-		dir = focus - cTop2 / 1.5;
 		lights[1].direction = vec4(dir.x, dir.y, dir.z, 1);
 	}
 };
 
+// Runs Scene::Animate in fixed steps, on its own thread when there is a window, and publishes a snapshot after
+// every step. Rendering interpolates between the last two snapshots one step behind the clock, so the frame rate
+// does not depend on the cost of the simulation. In headless mode the steps are taken on the main thread, the
+// clock of the framework drives them and the result is the same on every run.
+class SimulationLoop {
+	Scene& scene;
+	std::thread thread;
+	std::atomic<bool> running;
+	std::mutex mutex;
+	Snapshot previous, latest;	// the last two published states, guarded by mutex
+	Snapshot back;				// written by the simulation only
+	double simTime;
+	std::chrono::steady_clock::time_point start;
+	bool threaded;
+
+	void Publish() {
+		back.time = simTime;
+		std::lock_guard<std::mutex> lock(mutex);
+		std::swap(previous, latest);
+		std::swap(latest, back);
+	}
+
+	void Advance(double target) {	// simulate up to target seconds
+		for (int steps = 0; simTime + tickDt <= target; steps++) {
+			if (steps == maxCatchUpSteps) {	// drop the backlog of a stall instead of spiralling
+				simTime = target;
+				break;
+			}
+			scene.Animate(tickDt);
+			simTime += tickDt;
+			scene.Capture(back);
+			Publish();
+		}
+	}
+
+	void Run() {
+		while (running) {
+			Advance(Now());
+			std::this_thread::sleep_until(start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+				std::chrono::duration<double>(simTime + tickDt)));
+		}
+	}
+
+public:
+	const float tickDt = 0.01f;
+	const int maxCatchUpSteps = 25;
+
+	SimulationLoop(Scene& _scene) : scene(_scene), running(false), simTime(0), threaded(false) { }
+
+	double Now() {	// seconds on the clock of the simulation
+		if (!threaded) return elapsedTime() / 1000.0;
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	void Start(bool _threaded) {
+		threaded = _threaded;
+		start = std::chrono::steady_clock::now();
+		scene.Capture(back);
+		Publish();
+		scene.Capture(back);
+		Publish();
+		if (threaded) {
+			running = true;
+			thread = std::thread(&SimulationLoop::Run, this);
+		}
+	}
+
+	void Update() {	// main thread, once per frame
+		if (!threaded) Advance(Now());
+	}
+
+	void Interpolated(Snapshot& snapshot) {	// the state one step before now
+		double renderTime = Now() - tickDt;
+		std::lock_guard<std::mutex> lock(mutex);
+		double span = latest.time - previous.time;
+		float t = (span > 0) ? (float)((renderTime - previous.time) / span) : 1.0f;
+		snapshot.Interpolate(previous, latest, (t < 0) ? 0 : ((t > 1) ? 1 : t));
+	}
+
+	void Stop() {
+		running = false;
+		if (thread.joinable()) thread.join();
+	}
+
+	~SimulationLoop() { Stop(); }
+};
+
 Scene scene;
+SimulationLoop simulation(scene);	// destroyed before the scene, so the thread is joined first
+Snapshot frameSnapshot;
 
 void onInitialization() {
 	glViewport(0, 0, windowWidth, windowHeight);
 	glEnable(GL_DEPTH_TEST);
 	glDisable(GL_CULL_FACE);
 	scene.Build();
+	simulation.Start(!isHeadless());
 }
 
 void onDisplay() {
 	glClearColor(0.1f, 0.1f, 0.1f, 1.0f);
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-	scene.Render();
-	glutSwapBuffers();
+	simulation.Interpolated(frameSnapshot);
+	scene.Render(frameSnapshot);
+	swapBuffers();
 }
 
-void onKeyboard(unsigned char key, int pX, int pY) { }
+void onKeyboard(unsigned char key, int pX, int pY) {
+	if (key == 'i') scene.instancing = !scene.instancing;	// toggle instanced drawing
+	if (key == 'c') scene.lightGrid.clustered = !scene.lightGrid.clustered;	// toggle clustered lighting
+	if (key == 'l') scene.showLamps = !scene.showLamps;		// toggle the lamps on the floor
+	if (key == 'o') scene.occlusion.SetMode((OcclusionCuller::Mode)((scene.occlusion.GetMode() + 1) % 3));	// occlusion culling: off, queries, HiZ
+}
 
 void onKeyboardUp(unsigned char key, int pX, int pY) { }
 
@@ -597,15 +1963,11 @@ void onMouse(int button, int state, int pX, int pY) { }
 void onMouseMotion(int pX, int pY) { }
 
 void onIdle() {
-	float speed = 1;
-	static float tend = 0;
-	const float dt = 0.01f;
-	float tstart = tend;
-	tend = glutGet(GLUT_ELAPSED_TIME) / 1000.0f;
-	tend *= speed;
-	for (float t = tstart; t < tend; t += dt) {
-		float Dt = fmin(dt, tend - t);
-		scene.Animate(Dt);
-	}
-	glutPostRedisplay();
+	simulation.Update();
+	postRedisplay();
+}
+
+void onExit() {
+	simulation.Stop();	// the simulation thread reads the scene
+	scene.Release();
 }
\ No newline at end of file
@@ -515,7 +515,7 @@ void onDisplay() {
 
 	vs.DrawScene();
 
-	glutSwapBuffers();									
+	swapBuffers();									
 }
 
 
@@ -542,7 +542,7 @@ void onKeyboard(unsigned char key, int pX, int pY) {
 
 	secCoordCompass = false; secCoordLine = false; secCoordInter = false;
 	vs.DeletePicks();
-	glutPostRedisplay();        
+	postRedisplay();        
 }
 
 void onKeyboardUp(unsigned char key, int pX, int pY) { }
@@ -566,7 +566,7 @@ void onMouse(int button, int state, int pX, int pY) {
 				secCoordCompass = false;
 			}
 
-			glutPostRedisplay();
+			postRedisplay();
 		}
 
 		else if (compassOpen) {
@@ -575,7 +575,7 @@ void onMouse(int button, int state, int pX, int pY) {
 				secCoordCompass = true;
 			}
 
-			glutPostRedisplay();
+			postRedisplay();
 		}
 
 
@@ -587,7 +587,7 @@ void onMouse(int button, int state, int pX, int pY) {
 			}
 
 			circle = false;
-			glutPostRedisplay();
+			postRedisplay();
 		}
 
 		else if (secCoordLine) {
@@ -599,7 +599,7 @@ void onMouse(int button, int state, int pX, int pY) {
 				secCoordLine = false;
 			}
 
-			glutPostRedisplay();
+			postRedisplay();
 		}
 
 		else if (line) { 
@@ -609,7 +609,7 @@ void onMouse(int button, int state, int pX, int pY) {
 				secCoordLine = true;
 			}
 
-			glutPostRedisplay();
+			postRedisplay();
 		}
 
 		else if (secCoordInter) {
@@ -640,7 +640,7 @@ void onMouse(int button, int state, int pX, int pY) {
 				vs.DeletePicks();
 			}
 
-			glutPostRedisplay();
+			postRedisplay();
 		}
 
 		else if (intersection) {
@@ -657,7 +657,7 @@ void onMouse(int button, int state, int pX, int pY) {
 				vs.DeletePicks();
 			}
 			
-			glutPostRedisplay();
+			postRedisplay();
 		}
 		else {  }
 	}
@@ -665,4 +665,9 @@ void onMouse(int button, int state, int pX, int pY) {
 
 void onMouseMotion(int pX, int pY) {}
 
-void onIdle() { }
\ No newline at end of file
+void onIdle() { }
+
+void onExit() {
+	delete gpuProgram;
+	gpuProgram = nullptr;
+}
\ No newline at end of file
@@ -0,0 +1,74 @@
+//=============================================================================================
+// Accuracy of AffineInverse and NormalMatrix on random affine matrices, against a double precision reference.
+// Build it with the SSE path and with the scalar path, both have to pass:
+//   g++ -O2 -I.. matrix_accuracy.cpp -o matrix_accuracy
+//   g++ -O2 -I.. -DFRAMEWORK_NO_SIMD matrix_accuracy.cpp -o matrix_accuracy_scalar
+//=============================================================================================
+#include "framework.h"
+#include <random>
+
+#ifdef FRAMEWORK_SSE
+const double identityTolerance = 2e-5;	// max |M * AffineInverse(M) - I| with the float product of the path
+const char* path = "SSE";
+#else
+const double identityTolerance = 5e-6;
+const char* path = "scalar";
+#endif
+const double referenceTolerance = 5e-6;	// max error of an element relative to the largest element of the reference
+const int nMatrices = 100000;
+const double minDeterminant = 0.05;		// of the upper 3x3 block
+
+// inverse of the affine matrix in double precision by the adjugate of the upper 3x3 block, returns the determinant
+static double ReferenceInverse(const mat4& m, double inv[4][4]) {
+	double a[3][3];
+	for (int i = 0; i < 3; i++) for (int j = 0; j < 3; j++) a[i][j] = m[i][j];
+	double det = a[0][0] * (a[1][1] * a[2][2] - a[1][2] * a[2][1]) - a[0][1] * (a[1][0] * a[2][2] - a[1][2] * a[2][0])
+		+ a[0][2] * (a[1][0] * a[2][1] - a[1][1] * a[2][0]);
+	for (int i = 0; i < 3; i++) {
+		for (int j = 0; j < 3; j++) {	// cofactor of a[j][i]
+			int r0 = (j + 1) % 3, r1 = (j + 2) % 3, c0 = (i + 1) % 3, c1 = (i + 2) % 3;
+			inv[i][j] = (a[r0][c0] * a[r1][c1] - a[r0][c1] * a[r1][c0]) / det;
+		}
+		inv[i][3] = 0;
+	}
+	for (int j = 0; j < 3; j++) inv[3][j] = -(m[3][0] * inv[0][j] + m[3][1] * inv[1][j] + m[3][2] * inv[2][j]);
+	inv[3][3] = 1;
+	return det;
+}
+
+int main() {
+	std::mt19937 random(12345);
+	std::uniform_real_distribution<float> linear(-1, 1), translation(-10, 10);
+	double identityError = 0, inverseError = 0, normalError = 0;
+	int tested = 0;
+	while (tested < nMatrices) {
+		mat4 m;
+		for (int i = 0; i < 3; i++) m[i] = vec4(linear(random), linear(random), linear(random), 0);
+		m[3] = vec4(translation(random), translation(random), translation(random), 1);
+		double reference[4][4];
+		if (fabs(ReferenceInverse(m, reference)) < minDeterminant) continue;
+		tested++;
+
+		mat4 inv = AffineInverse(m), product = m * inv;
+		mat3 normalMatrix = NormalMatrix(m);
+		const float* normal = normalMatrix;
+		double scale = 0, normalScale = 0;
+		for (int i = 0; i < 4; i++) {
+			for (int j = 0; j < 4; j++) {
+				scale = fmax(scale, fabs(reference[i][j]));
+				if (i < 3 && j < 3) normalScale = fmax(normalScale, fabs(reference[i][j]));
+			}
+		}
+		for (int i = 0; i < 4; i++) {
+			for (int j = 0; j < 4; j++) {
+				identityError = fmax(identityError, fabs(product[i][j] - (i == j ? 1 : 0)));
+				inverseError = fmax(inverseError, fabs(inv[i][j] - reference[i][j]) / scale);
+				if (i < 3 && j < 3) normalError = fmax(normalError, fabs(normal[i * 3 + j] - reference[j][i]) / normalScale);
+			}
+		}
+	}
+	bool passed = identityError <= identityTolerance && inverseError <= referenceTolerance && normalError <= referenceTolerance;
+	printf("%s, %d matrices: max |M * AffineInverse(M) - I| %.3g, relative error of AffineInverse %.3g, of NormalMatrix %.3g, %s\n",
+		path, tested, identityError, inverseError, normalError, passed ? "passed" : "FAILED");
+	return passed ? 0 : 1;
+}